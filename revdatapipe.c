@@ -1,20 +1,33 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* splice() */
+#endif
+
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
+#include <zlib.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stdarg.h>
 #if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
     #define WIN32_LEAN_AND_MEAN
     #include <winsock.h>
     #define bzero(p, l) memset(p, 0, l)
     #define bcopy(s, t, l) memmove(t, s, l)
+    #define strcasecmp _stricmp
+    #define strtok_r strtok_s
+    typedef int socklen_t;
 #else
     #include <sys/time.h>
     #include <sys/types.h>
@@ -25,9 +38,24 @@
     #include <unistd.h>
     #include <netdb.h>
     #include <strings.h>
+    #include <pthread.h>
+    #include <stdatomic.h>
+    #include <signal.h>
+    #include <fcntl.h>
+    #include <sys/un.h>
+    #include <netinet/tcp.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <sys/stat.h>
+    #include <dirent.h>
+    #include <limits.h>
+    #ifdef __linux__
+        #include <sys/eventfd.h>
+    #endif
     #define recv(x,y,z,a) read(x,y,z)
     #define send(x,y,z,a) write(x,y,z)
     #define closesocket(s) close(s)
+    #define INVALID_SOCKET (-1)
     typedef int SOCKET;
 #endif
 
@@ -35,100 +63,5175 @@
 #define INADDR_NONE 0xffffffff
 #endif
 
-int main(int argc, char *argv[])
-{ 
-    char buf[4096];
-    struct sockaddr_in dest[2];
-    SOCKET sockfd[2];    
-    SOCKET maxsock = 0;
-    int i;
+/*
+ * Cached monotonic clock.
+ *
+ * The main loop calls clock_refresh() once per iteration, right after
+ * select() returns, and everything else (timers, rate limiters, stats)
+ * reads the cached value through clock_now_us()/clock_now_ms().  On Linux
+ * CLOCK_MONOTONIC is served from the vDSO, so one refresh costs a few tens
+ * of nanoseconds and there is never more than one clock read per iteration.
+ *
+ * Accuracy bound: the cached value is refreshed when the loop wakes up, so
+ * it lags the real clock by at most the time spent processing the current
+ * iteration (one recv/send per ready socket).  Consumers needing a fresher
+ * value may call clock_refresh() themselves.
+ */
+static unsigned long long now_us;
 
+static void clock_refresh(void)
+{
 #if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
-    /* Winsock needs additional startup activities */
-    WSADATA wsadata;
-    WSAStartup(MAKEWORD(1,1), &wsadata);
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER cnt;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    now_us = (unsigned long long) (cnt.QuadPart / freq.QuadPart) * 1000000ULL
+           + (unsigned long long) (cnt.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_us = (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 #endif
+}
 
-    
+static unsigned long long clock_now_us(void)
+{
+    return now_us;
+}
 
-    /* check number of command line arguments */
-    if (5 != argc) 
+static unsigned long long clock_now_ms(void)
+{
+    return now_us / 1000;
+}
+
+/*
+ * Asynchronous logger.
+ *
+ * Diagnostics are formatted into a fixed-size ring by the relay thread and
+ * written to stderr by a background writer thread, so a slow stderr (a full
+ * pipe, a backed-up journald) can never stall forwarding.  The ring has a
+ * single producer (the relay thread) and a single consumer (the writer), so
+ * head and tail are plain atomics without locks.  When the ring is full the
+ * message is dropped and counted; the writer reports the count later.
+ *
+ * Repeated messages are rate limited per format string, or per failed
+ * call for log_errno(): at most LOG_BURST messages per LOG_WINDOW_MS, the
+ * rest are counted and summarised once the window has passed, from the
+ * main loop's timers if nothing else is logged.  This keeps e.g. connect
+ * failures during a flap from flooding the ring.  Output that was asked
+ * for, like the stats dump, goes through log_dump(), which is never
+ * limited and waits for the writer to make room rather than drop lines.
+ */
+#define LOG_SLOTS       256
+#define LOG_LINE        256
+#define LOG_BURST       5
+#define LOG_WINDOW_MS   1000
+#define LOG_KEYS        32
+
+static struct log_key
+{
+    const char *fmt;
+    unsigned long long window_start;
+    unsigned int count;
+    unsigned int suppressed;
+} log_keys[LOG_KEYS];
+
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+/* no writer thread on Windows, lines go straight to stderr */
+static void log_push(const char *line)
+{
+    fputs(line, stderr);
+}
+
+static void log_init(void)
+{
+    clock_refresh();
+}
+#else
+static char log_ring[LOG_SLOTS][LOG_LINE];
+static atomic_uint log_head, log_tail, log_dropped;
+static atomic_int log_stop;
+static pthread_t log_thread;
+static int log_running;
+
+static void log_push(const char *line)
+{
+    unsigned int tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&log_head, memory_order_acquire) >= LOG_SLOTS)
     {
-        fprintf(stderr, "Usage: %s remotehost1 remoteport1 remotehost2 remoteport2\n", argv[0]);
-        return -1;
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
     }
+    strncpy(log_ring[tail % LOG_SLOTS], line, LOG_LINE - 1);
+    log_ring[tail % LOG_SLOTS][LOG_LINE - 1] = '\0';
+    atomic_store_explicit(&log_tail, tail + 1, memory_order_release);
+}
 
-    /* connect to servers */
-    for(i = 0; i < 2; ++i)
+/* block until the writer has room for one more line */
+static void log_wait_room(void)
+{
+    struct timespec nap = { 0, 1000 * 1000 };
+
+    while (log_running && atomic_load_explicit(&log_tail, memory_order_relaxed)
+                          - atomic_load_explicit(&log_head, memory_order_acquire) >= LOG_SLOTS)
+        nanosleep(&nap, NULL);
+}
+
+static void *log_writer(void *arg)
+{
+    struct timespec nap = { 0, 5 * 1000 * 1000 };
+    unsigned int head, dropped;
+
+    (void) arg;
+    for (;;)
     {
-        bzero(&dest[i], sizeof(dest[i]));
-        dest[i].sin_family = AF_INET;
-        dest[i].sin_port = htons((unsigned short) atol(argv[2 + i * 2]));
-        if (!dest[i].sin_port)
+        head = atomic_load_explicit(&log_head, memory_order_relaxed);
+        while (head != atomic_load_explicit(&log_tail, memory_order_acquire))
         {
-            fprintf(stderr, "invalid target port\n");
-            return -1;
+            fputs(log_ring[head % LOG_SLOTS], stderr);
+            atomic_store_explicit(&log_head, ++head, memory_order_release);
         }
-        dest[i].sin_addr.s_addr = inet_addr(argv[1 + i * 2]);
-        if (dest[i].sin_addr.s_addr == INADDR_NONE)
+        if ((dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed)))
+            fprintf(stderr, "log: %u messages dropped\n", dropped);
+        fflush(stderr);
+        if (atomic_load_explicit(&log_stop, memory_order_acquire)
+            && head == atomic_load_explicit(&log_tail, memory_order_acquire))
+            break;
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+#endif
+
+/* report what key k held back */
+static void log_summary(struct log_key *k)
+{
+    char line[LOG_LINE];
+
+    if (!k->suppressed)
+        return;
+    snprintf(line, sizeof(line), "(%u similar messages suppressed)\n", k->suppressed);
+    log_push(line);
+    k->suppressed = 0;
+}
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+static void log_shutdown(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < LOG_KEYS; ++i)
+        log_summary(&log_keys[i]);
+    if (!log_running)
+        return;
+    atomic_store_explicit(&log_stop, 1, memory_order_release);
+    pthread_join(log_thread, NULL);
+    log_running = 0;
+}
+
+static void log_init(void)
+{
+    clock_refresh();
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) == 0)
+    {
+        log_running = 1;
+        atexit(log_shutdown);
+    }
+}
+#endif
+
+/* returns nonzero if a message with this format may be logged right now */
+static int log_admit(const char *fmt)
+{
+    struct log_key *k = &log_keys[((size_t) fmt >> 3) % LOG_KEYS];
+    unsigned long long now = clock_now_ms();
+
+    if (k->fmt != fmt || now - k->window_start >= LOG_WINDOW_MS)
+    {
+        log_summary(k);
+        k->fmt = fmt;
+        k->window_start = now;
+        k->count = 0;
+    }
+    if (++k->count > LOG_BURST)
+    {
+        ++k->suppressed;
+        return 0;
+    }
+    return 1;
+}
+
+/* summarise keys whose window ended with messages held back */
+static void log_run(void)
+{
+    int i;
+
+    for (i = 0; i < LOG_KEYS; ++i)
+        if (log_keys[i].suppressed && clock_now_ms() - log_keys[i].window_start >= LOG_WINDOW_MS)
+            log_summary(&log_keys[i]);
+}
+
+/* ms until a summary is due, -1 if none is pending */
+static long log_next_wakeup(void)
+{
+    unsigned long long next = 0, due;
+    int i;
+
+    for (i = 0; i < LOG_KEYS; ++i)
+    {
+        if (!log_keys[i].suppressed)
+            continue;
+        due = log_keys[i].window_start + LOG_WINDOW_MS;
+        if (!next || due < next)
+            next = due;
+    }
+    if (!next)
+        return -1;
+    return next > clock_now_ms() ? (long) (next - clock_now_ms()) : 0;
+}
+
+/* format one line into the ring; if wait, block for room instead of dropping it */
+static void log_vpush(int wait, const char *fmt, va_list ap)
+{
+    char line[LOG_LINE];
+    int n;
+
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    if (n < 0)
+        return;
+    if (n > (int) sizeof(line) - 2)
+        n = sizeof(line) - 2;
+    line[n] = '\n';
+    line[n + 1] = '\0';
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+    if (wait)
+        log_wait_room();
+#else
+    (void) wait;
+#endif
+    log_push(line);
+}
+
+static void log_msg(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!log_admit(fmt))
+        return;
+    va_start(ap, fmt);
+    log_vpush(0, fmt, ap);
+    va_end(ap);
+}
+
+/* like log_msg(), rate limited under key instead of the format */
+static void log_keyed(const char *key, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!log_admit(key))
+        return;
+    va_start(ap, fmt);
+    log_vpush(0, fmt, ap);
+    va_end(ap);
+}
+
+/* like log_msg(), for output that was asked for and must be complete */
+static void log_dump(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vpush(1, fmt, ap);
+    va_end(ap);
+}
+
+/* non-blocking replacement for perror() */
+static void log_errno(const char *what)
+{
+    int err = errno;
+
+    /* keyed on what failed, so a flapping connect cannot hold back a failing msync */
+    log_keyed(what, "%s: %s", what, strerror(err));
+}
+
+/*
+ * Relay pairs.
+ *
+ * A pair joins two outgoing connections and copies bytes between them.  The
+ * pair given on the command line is pair 0, more can be added and removed at
+ * runtime through the control socket.  The table is fixed-size because
+ * select() cannot watch more than FD_SETSIZE descriptors anyway.
+ */
+#define MAX_PAIRS 256
+
+/* leg states; a pair relays once both legs are up */
+#define LEG_QUEUED      0   /* waiting for the connect scheduler */
+#define LEG_CONNECTING  1   /* non-blocking connect() in flight */
+#define LEG_UP          2
+#define LEG_ROUTING     3   /* leg two waits for leg one's TLS handshake to pick its backend */
+#define LEG_HELLO       4   /* leg one is up for TLS but its client has sent nothing yet */
+
+/* on-disk spool of one pair, see "Store-and-forward spool" */
+struct spool
+{
+    char name[24];                  /* segment file prefix, "" if the pair does not spool */
+    unsigned int rseq, wseq;        /* segments being drained and appended to */
+    char *rmap, *wmap;
+    size_t roff, rlen;              /* drain position and end of a sealed rseq segment */
+    size_t woff, synced;            /* append position and how much of it is on disk */
+    unsigned long long bytes;       /* spooled and not drained yet */
+};
+
+struct pair
+{
+    int used;
+    int paused;
+    SOCKET fd[2];
+    SOCKET wfd[2];                  /* what leg i is written to, fd[i] except for stdio */
+    struct sockaddr_in dest[2];
+    int state[2];
+    unsigned long long when[2];     /* ms: earliest start if queued, deadline if connecting */
+    unsigned long long bytes[2];    /* received on leg i, sent on the other */
+    int pool, backend;              /* where leg two came from, -1 if not pooled */
+    unsigned long long first_sent;  /* ms when leg two got its first byte, for outlier detection */
+    int first_seen;                 /* leg two has answered */
+    unsigned int pace[2];           /* max send rate on leg i in bytes/s, 0 if unpaced */
+    unsigned long long win_start;   /* ms, start of the current rate window */
+    unsigned long long win_bytes[2];
+    unsigned long long rate[2];     /* achieved bytes/s over the last window, as bytes[] */
+    unsigned long long last_rx[2];  /* ms leg i last delivered anything */
+    char *buf[2];                   /* received on leg i, waiting to go out on the other */
+    size_t bufsize[2], bufwant[2];
+    size_t len[2], off[2];          /* buf[i][off..len) is still to be sent */
+    int stdio[2];                   /* leg i is stdin/stdout */
+    int splice[2];                  /* direction i moves by splice() instead of buf[i] */
+    int blocked[2];                 /* spliced direction i waits for its destination */
+    struct spool spool;
+    struct session *sess;           /* leg two is a session link, see "Resumable sessions" */
+    int eof;                        /* leg one is done, close once its data is passed on */
+    int udp;                        /* leg one is UDP, see "UDP legs" */
+    SSL *ssl[2];                    /* leg i speaks TLS, see "TLS legs" */
+    char *tls_host;                 /* name leg two's certificate must have, NULL for any */
+    int handshake[2];               /* connecting leg i is in its TLS handshake */
+    int hs_read[2];                 /* which waits for readability rather than writability */
+    int tls_small[2];               /* leg i currently sends small records */
+    int tls_retry[2];               /* and has a record SSL_write must be retried with */
+    unsigned long long tls_ramp[2]; /* bytes it sends in small records after idling */
+    unsigned long long tls_sent[2]; /* bytes it sent since it last idled */
+    unsigned long long tls_last[2]; /* ms it last sent */
+    unsigned long long dropped;     /* datagrams from leg one too long to carry */
+};
+
+static struct pair pairs[MAX_PAIRS];
+static int npairs;
+
+/*
+ * Connect scheduler.
+ *
+ * Firing thousands of connect()s at once (a mass startup, a burst of "add"
+ * commands) overflows SYN backlogs and the resulting retransmit timeouts
+ * make the whole ramp slower than a paced one.  Legs are therefore queued
+ * and started by connect_schedule() with at most connect_max connects in
+ * flight overall and connect_per_dest to any one address, each delayed by
+ * a random jitter of up to connect_jitter ms.  A finished connect frees its
+ * slot for the next queued leg in the same loop iteration, which keeps the
+ * pipeline full and minimises time-to-all-connected.
+ *
+ * A ramp starts when the queue goes from idle to busy and ends when no leg
+ * is queued or connecting; its duration is logged as the time-to-all-
+ * connected figure.
+ */
+#define CONNECT_TIMEOUT_MS 5000
+
+static int connect_max = 128;
+static int connect_per_dest = 32;
+static int connect_jitter = 2;
+static int legs_queued, legs_connecting;
+static unsigned long long ramp_start;
+static unsigned int ramp_legs, ramp_failed, connect_failures;
+
+static int set_nonblock(SOCKET fd, int on)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    u_long arg = on;
+
+    return ioctlsocket(fd, FIONBIO, &arg);
+#else
+    int fl = fcntl(fd, F_GETFL);
+
+    return fcntl(fd, F_SETFL, on ? fl | O_NONBLOCK : fl & ~O_NONBLOCK);
+#endif
+}
+
+static int connect_in_progress(void)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+static int would_block(void)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* a send or receive on a connected UDP socket reported an ICMP error from earlier */
+static int peer_refused(void)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    return WSAGetLastError() == WSAECONNRESET;
+#else
+    return errno == ECONNREFUSED;
+#endif
+}
+
+/* the earlier of two wakeups in ms, -1 meaning none */
+static long wakeup_min(long a, long b)
+{
+    return a < 0 || (b >= 0 && b < a) ? b : a;
+}
+
+/* fill in sa from a host name or dotted quad and a port */
+static int resolve(const char *host, const char *port, struct sockaddr_in *sa)
+{
+    bzero(sa, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons((unsigned short) atol(port));
+    if (!sa->sin_port)
+    {
+        log_msg("invalid target port");
+        return -1;
+    }
+    sa->sin_addr.s_addr = inet_addr(host);
+    if (sa->sin_addr.s_addr == INADDR_NONE)
+    {
+        struct hostent *n;
+        if (NULL == (n = gethostbyname(host)))
         {
-            struct hostent *n;
-            if (NULL == (n = gethostbyname(argv[1 + i * 2])))
-            {
-              perror("gethostbyname");
-              return -1;
-            }    
-            bcopy(n->h_addr, (char *) &dest[i].sin_addr, n->h_length);
+            log_errno("gethostbyname");
+            return -1;
         }
+        bcopy(n->h_addr, (char *) &sa->sin_addr, n->h_length);
+    }
+    return 0;
+}
+
+/*
+ * Backend pools.
+ *
+ * remotehost2 may list several backends as "host[:port],host[:port],..."
+ * with remoteport2 as the default port.  Leg two of each pair is then
+ * picked by consistent hashing of a session key (leg one's host:port
+ * unless the control "add" names one), so a session keeps landing on the
+ * same backend and that backend's caches stay warm.  Loads are bounded as
+ * in "consistent hashing with bounded loads": walking the ring from the
+ * key's point, a backend already carrying load_factor times the average
+ * number of pairs is skipped, so affinity never makes a backend hot.
+ */
+#define MAX_POOLS       16
+#define MAX_BACKENDS    16
+#define POOL_VNODES     64
+#define POOL_SPEC       256
+
+struct backend
+{
+    char host[POOL_SPEC];               /* as listed, the name a TLS leg verifies */
+    struct sockaddr_in addr;
+    int load;
+    int fails;                          /* consecutive failed or slow sessions */
+    unsigned long long ejected_until;   /* ms, 0 if in service */
+    SOCKET probe;                       /* health probe in flight */
+    unsigned long long probe_at;        /* ms: next probe, or its deadline while in flight */
+};
+
+struct ring_point
+{
+    unsigned int hash;
+    int backend;
+};
 
-        if ((sockfd[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0) 
+static struct pool
+{
+    char spec[POOL_SPEC];           /* "list/defaultport" */
+    int nbackends, total;
+    struct backend backends[MAX_BACKENDS];
+    struct ring_point ring[MAX_BACKENDS * POOL_VNODES];
+} pools[MAX_POOLS];
+static int npools;
+static double load_factor = 1.25;
+
+/* FNV-1a */
+static unsigned int hash_str(const char *s)
+{
+    unsigned int h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static int ring_cmp(const void *a, const void *b)
+{
+    unsigned int x = ((const struct ring_point *) a)->hash, y = ((const struct ring_point *) b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+/* find or build the pool for a backend list, returns its index or -1 */
+static int pool_get(const char *list, const char *port)
+{
+    char spec[POOL_SPEC], item[POOL_SPEC], vnode[POOL_SPEC + 16], *sep;
+    const char *p, *bport;
+    struct pool *pl;
+    int n, i, v;
+
+    if ((size_t) snprintf(spec, sizeof(spec), "%s/%s", list, port) >= sizeof(spec))
+    {
+        log_msg("backend list too long");
+        return -1;
+    }
+    for (i = 0; i < npools; ++i)
+        if (!strcmp(pools[i].spec, spec))
+            return i;
+    if (npools == MAX_POOLS)
+    {
+        log_msg("too many backend pools");
+        return -1;
+    }
+
+    pl = &pools[npools];
+    bzero(pl, sizeof(*pl));
+    for (i = 0; i < MAX_BACKENDS; ++i)
+        pl->backends[i].probe = INVALID_SOCKET;
+    for (p = list; *p; p += n + (p[n] == ','))
+    {
+        n = strcspn(p, ",");
+        if (pl->nbackends == MAX_BACKENDS)
         {
-            perror("socket");
+            log_msg("too many backends in list");
             return -1;
         }
-        if (sockfd[i] > maxsock)
-            maxsock = sockfd[i];
-        if (connect(sockfd[i], (struct sockaddr *)&dest[i], sizeof(dest[i])))
+        memcpy(item, p, n);
+        item[n] = '\0';
+        bport = port;
+        if ((sep = strchr(item, ':')))
         {
-            perror("connect");
-            closesocket(sockfd[i]);
+            *sep = '\0';
+            bport = sep + 1;
         }
+        if (resolve(item, bport, &pl->backends[pl->nbackends].addr))
+            return -1;
+        strcpy(pl->backends[pl->nbackends].host, item);
+        for (v = 0; v < POOL_VNODES; ++v)
+        {
+            snprintf(vnode, sizeof(vnode), "%s:%s#%d", item, bport, v);
+            pl->ring[pl->nbackends * POOL_VNODES + v].hash = hash_str(vnode);
+            pl->ring[pl->nbackends * POOL_VNODES + v].backend = pl->nbackends;
+        }
+        ++pl->nbackends;
+    }
+    if (!pl->nbackends)
+    {
+        log_msg("empty backend list");
+        return -1;
     }
+    qsort(pl->ring, pl->nbackends * POOL_VNODES, sizeof(pl->ring[0]), ring_cmp);
+    strcpy(pl->spec, spec);
+    return npools++;
+}
+
+static int backend_ejected(const struct backend *b)
+{
+    return b->ejected_until > clock_now_ms();
+}
 
-    // openssl goes after connect
+/*
+ * Pick the backend for a session key and charge it one pair.  Ejected
+ * backends are skipped unless every backend is ejected, in which case
+ * they are all used as if healthy rather than failing the session.
+ */
+static int pool_pick(struct pool *pl, const char *key)
+{
+    unsigned int h = hash_str(key);
+    int nring = pl->nbackends * POOL_VNODES, lo = 0, hi = nring, i, b = 0, healthy = 0, pass;
+    double cap;
 
-    fd_set fdsr;
-    int nbyt, closeneeded = 0;
+    for (b = 0; b < pl->nbackends; ++b)
+        healthy += !backend_ejected(&pl->backends[b]);
 
-    /* main polling loop. */
-    while (1)
+    /* first ring point at or after the key */
+    while (lo < hi)
     {
-        FD_ZERO(&fdsr);
-        FD_SET(sockfd[0], &fdsr);
-        FD_SET(sockfd[1], &fdsr);
-        if (select(maxsock + 1, &fdsr, NULL, NULL, NULL) < 0) {
-            return -1;
+        i = (lo + hi) / 2;
+        if (pl->ring[i].hash < h)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    /* loads sum to total < cap * candidates, so some candidate is below cap */
+    for (pass = healthy ? 0 : 1; pass < 2; ++pass)
+    {
+        cap = load_factor * (pl->total + 1) / (pass ? pl->nbackends : healthy);
+        for (i = 0; i < nring; ++i)
+        {
+            b = pl->ring[(lo + i) % nring].backend;
+            if ((pass || !backend_ejected(&pl->backends[b])) && pl->backends[b].load < cap)
+                goto found;
         }
+    }
+found:
+    ++pl->backends[b].load;
+    ++pl->total;
+    return b;
+}
+
+/*
+ * Backend health.
+ *
+ * Passive outlier detection: every failed connect to a pooled backend and
+ * every session whose first response byte takes longer than
+ * SLOW_FIRST_BYTE_MS counts against the backend, and EJECT_FAILS such
+ * events in a row take it out of its pool for EJECT_MS.  Active checking
+ * (-H interval) additionally probes each pooled backend with a plain TCP
+ * connect: a failed probe ejects the backend at once and a good one puts
+ * it back early.  Probes run from the main loop like the connect
+ * scheduler, so sessions stop being sent to dead hosts before they have
+ * to find out by timing out themselves.
+ */
+#define EJECT_FAILS         3
+#define EJECT_MS            10000
+#define SLOW_FIRST_BYTE_MS  2000
+#define PROBE_TIMEOUT_MS    1000
+
+static int health_interval;
+
+static const char *backend_name(const struct backend *b)
+{
+    static char name[32];
+
+    snprintf(name, sizeof(name), "%s:%d", inet_ntoa(b->addr.sin_addr), ntohs(b->addr.sin_port));
+    return name;
+}
+
+static void backend_eject(struct backend *b)
+{
+    if (!backend_ejected(b))
+        log_msg("backend %s ejected", backend_name(b));
+    b->ejected_until = clock_now_ms() + EJECT_MS;
+    b->fails = 0;
+}
+
+static void backend_failed(struct backend *b)
+{
+    if (++b->fails >= EJECT_FAILS)
+        backend_eject(b);
+}
+
+static void backend_ok(struct backend *b)
+{
+    b->fails = 0;
+}
+
+static void probe_done(struct backend *b, int ok)
+{
+    closesocket(b->probe);
+    b->probe = INVALID_SOCKET;
+    b->probe_at = clock_now_ms() + health_interval;
+    if (!ok)
+        backend_eject(b);
+    else if (backend_ejected(b))
+    {
+        log_msg("backend %s back in service", backend_name(b));
+        b->ejected_until = 0;
+    }
+}
 
-        nbyt = 0;
-        closeneeded = 0;
+/* start the probes that are due */
+static void health_run(void)
+{
+    struct backend *b;
+    int pl, i;
 
-        if (FD_ISSET(sockfd[0], &fdsr))
+    if (!health_interval)
+        return;
+    for (pl = 0; pl < npools; ++pl)
+    {
+        for (i = 0; i < pools[pl].nbackends; ++i)
         {
-            if ((nbyt = recv(sockfd[0], buf, sizeof(buf), 0)) <= 0 || send(sockfd[1], buf, nbyt, 0) <= 0) 
-                closeneeded = 1;
+            b = &pools[pl].backends[i];
+            if (b->probe != INVALID_SOCKET || b->probe_at > clock_now_ms())
+                continue;
+            if ((b->probe = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            {
+                b->probe = INVALID_SOCKET;
+                continue;
+            }
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+            if (b->probe >= FD_SETSIZE)
+            {
+                closesocket(b->probe);
+                b->probe = INVALID_SOCKET;
+                continue;
+            }
+#endif
+            set_nonblock(b->probe, 1);
+            if (connect(b->probe, (struct sockaddr *) &b->addr, sizeof(b->addr)) == 0)
+                probe_done(b, 1);
+            else if (connect_in_progress())
+                b->probe_at = clock_now_ms() + PROBE_TIMEOUT_MS;
+            else
+                probe_done(b, 0);
         }
-        else if (FD_ISSET(sockfd[1], &fdsr))
+    }
+}
+
+static void health_fdset(fd_set *fdsw, SOCKET *maxsock)
+{
+    int pl, i;
+
+    for (pl = 0; pl < npools; ++pl)
+    {
+        for (i = 0; i < pools[pl].nbackends; ++i)
         {
-            if ((nbyt = recv(sockfd[1], buf, sizeof(buf), 0)) <= 0 || send(sockfd[0], buf, nbyt, 0) <= 0) 
-                closeneeded = 1;
+            if (pools[pl].backends[i].probe == INVALID_SOCKET)
+                continue;
+            FD_SET(pools[pl].backends[i].probe, fdsw);
+            if (pools[pl].backends[i].probe > *maxsock)
+                *maxsock = pools[pl].backends[i].probe;
         }
-        if (closeneeded) 
+    }
+}
+
+/* collect probe results */
+static void health_check(fd_set *fdsw)
+{
+    struct backend *b;
+    int pl, i, err;
+    socklen_t len;
+
+    for (pl = 0; pl < npools; ++pl)
+    {
+        for (i = 0; i < pools[pl].nbackends; ++i)
         {
-            closesocket(sockfd[0]);
-            closesocket(sockfd[1]);
-        }      
+            b = &pools[pl].backends[i];
+            if (b->probe == INVALID_SOCKET)
+                continue;
+            if (FD_ISSET(b->probe, fdsw))
+            {
+                err = 0;
+                len = sizeof(err);
+                probe_done(b, getsockopt(b->probe, SOL_SOCKET, SO_ERROR, (char *) &err, &len) == 0 && !err);
+            }
+            else if (clock_now_ms() >= b->probe_at)
+                probe_done(b, 0);
+        }
+    }
+}
+
+/* ms until the next probe starts or times out, -1 if never */
+static long health_next_wakeup(void)
+{
+    unsigned long long next = ~0ULL, now = clock_now_ms();
+    int pl, i;
+
+    if (!health_interval)
+        return -1;
+    for (pl = 0; pl < npools; ++pl)
+        for (i = 0; i < pools[pl].nbackends; ++i)
+            if (pools[pl].backends[i].probe_at < next)
+                next = pools[pl].backends[i].probe_at;
+    if (next == ~0ULL)
+        return -1;
+    return next > now ? (long) (next - now) : 0;
+}
+
+/*
+ * Relay buffers and real-time mode.
+ *
+ * Relay buffers normally come from malloc.  With -R the process instead
+ * preallocates one RELAY_BUF_MIN buffer for each direction of every pair
+ * slot at startup, touches every page of them and of a generous slice of
+ * stack, and locks all of its memory with mlockall().  Pair slots, backend
+ * pools, the log ring and the command queue are static already, so from
+ * then on the relay path neither allocates nor faults.  That claim is
+ * checked rather than assumed: page faults taken while servicing pairs are
+ * counted per loop iteration, as is any buffer request the pool cannot
+ * serve, and both show up in the log and the stats dump.
+ *
+ * A pair otherwise keeps its relay buffers for as long as it lives, which
+ * adds up to 32 KiB or more per mostly idle connection.  With -L IDLEMS a
+ * direction that has been empty and has received nothing for IDLEMS gives
+ * its buffer back, and the next read takes a fresh one; TLS legs likewise
+ * run with SSL_MODE_RELEASE_BUFFERS, so OpenSSL frees its record buffers
+ * whenever they are empty.  An idle pair then holds no buffer memory
+ * beyond its slot, its sockets and the TLS connection state.  OpenSSL
+ * mallocs those record buffers again on the next record, out of sight of
+ * the -R allocation count, so -L and -R do not go together with TLS.
+ */
+#define RELAY_BUF_MIN   (16 * 1024)
+#define RELAY_BUF_MAX   (256 * 1024)
+#define RT_BUFS         (MAX_PAIRS * 2)
+#define RT_STACK        (256 * 1024)
+
+static int realtime;
+static char *rt_pool;
+static char *rt_free[RT_BUFS];
+static int rt_nfree;
+static unsigned long long rt_faults, rt_allocs;
+static unsigned long long trim_ms, trim_next;   /* -L */
+static unsigned long long relay_held;           /* bytes in relay buffers */
+
+static char *relay_buf_get(size_t size)
+{
+    if (!realtime)
+        return malloc(size);
+    if (rt_nfree && size <= RELAY_BUF_MIN)
+        return rt_free[--rt_nfree];
+    ++rt_allocs;
+    log_msg("realtime: relay buffer allocated outside the pool");
+    return malloc(size);
+}
+
+static void relay_buf_put(char *buf)
+{
+    if (realtime && buf >= rt_pool && buf < rt_pool + (size_t) RT_BUFS * RELAY_BUF_MIN)
+        rt_free[rt_nfree++] = buf;
+    else
+        free(buf);
+}
+
+/* give back the relay buffer of direction i */
+static void relay_buf_drop(struct pair *p, int i)
+{
+    if (!p->buf[i])
+        return;
+    relay_buf_put(p->buf[i]);
+    relay_held -= p->bufsize[i];
+    p->buf[i] = NULL;
+    p->bufsize[i] = 0;
+}
+
+/* with -L, drop the buffers of directions that have gone idle */
+static void relay_trim(void)
+{
+    struct pair *p;
+    int id, i;
+
+    if (!trim_ms || clock_now_ms() < trim_next)
+        return;
+    trim_next = clock_now_ms() + trim_ms;
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        p = &pairs[id];
+        if (!p->used || p->sess)    /* a session link keeps its own state in buf[0] */
+            continue;
+        for (i = 0; i < 2; ++i)
+            if (p->buf[i] && !p->len[i] && clock_now_ms() - p->last_rx[i] >= trim_ms)
+                relay_buf_drop(p, i);
+    }
+}
+
+/* ms until the next trimming pass, -1 if none is needed */
+static long trim_next_wakeup(void)
+{
+    if (!trim_ms || !relay_held)
+        return -1;
+    return trim_next > clock_now_ms() ? (long) (trim_next - clock_now_ms()) : 0;
+}
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+/* write one byte of every page, through volatile so the compiler cannot drop the writes */
+static void rt_touch(volatile char *mem, size_t len)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE), off;
+
+    for (off = 0; off < len; off += page)
+        mem[off] = 0;
+    mem[len - 1] = 0;
+}
+
+/* fault in a slice of stack so the relay path never grows it */
+static void rt_prefault_stack(void)
+{
+    volatile char stack[RT_STACK];
+
+    rt_touch(stack, sizeof(stack));
+}
+
+static int rt_init(void)
+{
+    int i;
+
+    if (!(rt_pool = malloc((size_t) RT_BUFS * RELAY_BUF_MIN)))
+    {
+        log_msg("realtime: cannot preallocate relay buffers");
+        return -1;
+    }
+    rt_touch(rt_pool, (size_t) RT_BUFS * RELAY_BUF_MIN);
+    for (i = 0; i < RT_BUFS; ++i)
+        rt_free[rt_nfree++] = rt_pool + (size_t) i * RELAY_BUF_MIN;
+    rt_prefault_stack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        log_errno("mlockall");
+        return -1;
+    }
+    return 0;
+}
+
+/* page faults taken by the relay thread so far */
+static long rt_fault_count(void)
+{
+    struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#else
+    getrusage(RUSAGE_SELF, &ru);
+#endif
+    return ru.ru_minflt + ru.ru_majflt;
+}
+#endif
+
+/*
+ * Pacing.
+ *
+ * A leg can be capped to a send rate with SO_MAX_PACING_RATE, which has the
+ * kernel (the fq qdisc, or TCP's internal pacing on Linux 4.13 and later)
+ * space out packets instead of bursting a whole window onto the wire.  That
+ * keeps bulk tunnels from filling WAN queues at the expense of interactive
+ * ones, at no per-chunk cost in this process.  The rate is set with -r for
+ * new legs and changed live with the "rate" control command; the achieved
+ * rate of each direction is measured over RATE_WINDOW_MS for "stats".
+ */
+#define RATE_WINDOW_MS 1000
+
+static unsigned int pace_default;
+
+/* apply p->pace[i] to leg i, returns -1 if the kernel refused it */
+static int leg_pace(struct pair *p, int i)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int rate = p->pace[i] ? p->pace[i] : ~0U;
+
+    if (p->stdio[i])
+        return p->pace[i] ? -1 : 0;
+    if (p->fd[i] == INVALID_SOCKET)
+        return 0;
+    if (setsockopt(p->fd[i], SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+    {
+        log_errno("SO_MAX_PACING_RATE");
+        return -1;
+    }
+    return 0;
+#else
+    (void) i;
+    return p->pace[i] ? -1 : 0;
+#endif
+}
+
+/* close the current rate window */
+static void rate_roll(struct pair *p)
+{
+    unsigned long long elapsed = clock_now_ms() - p->win_start;
+    int i;
+
+    if (!elapsed)
+        return;
+    for (i = 0; i < 2; ++i)
+    {
+        p->rate[i] = p->win_bytes[i] * 1000 / elapsed;
+        p->win_bytes[i] = 0;
+    }
+    p->win_start = clock_now_ms();
+}
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+/*
+ * Standard I/O legs.
+ *
+ * A leg given as "-" (with any port, "-" by convention) reads stdin and
+ * writes stdout, so revdatapipe can serve as an ssh ProxyCommand or sit
+ * in a shell pipeline.  Only one leg in the process can be the stdio one.
+ * When stdin or stdout is a pipe, bytes move between it and the other
+ * leg's socket with splice() and never pass through a user-space buffer.
+ */
+#define SPLICE_CHUNK (64 * 1024)
+
+static int stdio_taken, stdio_hooked;
+static int stdio_flags[2];
+
+static void stdio_restore(void)
+{
+    fcntl(0, F_SETFL, stdio_flags[0]);
+    fcntl(1, F_SETFL, stdio_flags[1]);
+}
+
+static int is_fifo(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static int stdio_open(struct pair *p, int i)
+{
+    if (stdio_taken)
+    {
+        log_msg("only one leg can be stdin/stdout");
+        return -1;
+    }
+    stdio_taken = 1;
+
+    /* stdin/stdout may be shared with a shell, put their flags back on exit */
+    stdio_flags[0] = fcntl(0, F_GETFL);
+    stdio_flags[1] = fcntl(1, F_GETFL);
+    if (!stdio_hooked++)
+        atexit(stdio_restore);
+    set_nonblock(0, 1);
+    set_nonblock(1, 1);
+
+    p->stdio[i] = 1;
+    p->fd[i] = 0;
+    p->wfd[i] = 1;
+#ifdef SPLICE_F_MOVE
+    p->splice[i] = is_fifo(0);
+    p->splice[!i] = is_fifo(1);
+#endif
+    return 0;
+}
+
+/* give back the stdio leg of a pair that could not be opened after all */
+static void stdio_release(struct pair *p)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (!p->stdio[i])
+            continue;
+        stdio_restore();
+        stdio_taken = 0;
+        p->stdio[i] = 0;
+        p->fd[i] = p->wfd[i] = INVALID_SOCKET;
+        p->splice[0] = p->splice[1] = 0;
+    }
+}
+#endif
+
+/*
+ * UDP legs.
+ *
+ * With -u PORT leg one is a UDP socket bound to local PORT (0 for any)
+ * and connected to remotehost1:remoteport1, so that applications at both
+ * ends can address it, and leg two carries its datagrams for paths that
+ * only let TCP through.
+ * Each datagram goes into the stream after a 16-bit length, as many per
+ * write as the relay buffer holds, and the revdatapipe at the far end
+ * (run with -u too) takes them out again and sends them on with their
+ * boundaries intact.  On Linux up to UDP_BATCH datagrams move per system
+ * call each way, with recvmmsg() and sendmmsg().  Datagrams longer than
+ * UDP_DGRAM_MAX are dropped and counted.  Nothing paces a UDP sender, so
+ * the socket gets UDP_SOCKBUF of buffer (as far as the system limit
+ * allows) to ride out bursts while leg two is busy.
+ */
+#define UDP_SLOT        4096                /* a datagram, its length and a byte to tell it was cut */
+#define UDP_DGRAM_MAX   (UDP_SLOT - 3)
+#define UDP_BATCH       32
+#define UDP_SOCKBUF     (4 * 1024 * 1024)
+#define UDP_BUF_MIN     (RELAY_BUF_MIN + UDP_SLOT)  /* leg two: a held partial datagram and a whole TLS record */
+
+static int udp_mode;
+static unsigned short udp_port;             /* host order */
+
+/* size the buffers of leg one of a UDP pair and bind it to udp_port */
+static int udp_bind(SOCKET fd)
+{
+    struct sockaddr_in sa;
+    int size = UDP_SOCKBUF;
+
+    bzero(&sa, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(udp_port);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *) &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *) &size, sizeof(size));
+    if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)))
+    {
+        log_errno("bind");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * TLS legs.
+ *
+ * With -T leg two is a TLS client connection.  Once TCP is up the leg
+ * goes through the handshake, still counted as connecting and under the
+ * same deadline, sending remotehost2 (or -N NAME) as SNI and requiring a
+ * certificate for that name from the system trust store or -A CAFILE.
+ * With a backend list the name is that of the backend picked.
+ * All relay I/O then goes through leg_recv()/leg_send(), which stand in
+ * for recv()/send() on any leg and report a TLS leg that wants to wait
+ * as a would-block.  Whatever OpenSSL has decrypted but not handed out
+ * yet, when a record was larger than the buffer it was read into, makes
+ * no socket readable, so a leg with such bytes counts as readable and
+ * keeps select() from sleeping until they are taken.
+ *
+ * A record can only be decrypted once all of it has arrived, so a full
+ * 16 KiB record spread over a dozen TCP segments holds back the first
+ * bytes of a response whenever one of them is lost or the congestion
+ * window is still small.  A TLS leg therefore sends records that fit one
+ * TCP segment (TLS_RECORD_SMALL) until it has sent -W bytes in them
+ * (TLS_RAMP by default), then full records, which cost far less CPU and
+ * framing per byte on bulk transfers.  After TLS_IDLE_MS without sending,
+ * when the congestion window will have shrunk again, it starts small
+ * again.  -W 0 means full records throughout, and "record ID LEG BYTES"
+ * on the control socket sets the ramp for one leg of a running pair.
+ * Small records are made by handing SSL_write() one record's worth at a
+ * time: OpenSSL sizes its write buffer once, so raising the maximum
+ * fragment size again on a live connection is not an option.
+ */
+#define TLS_RECORD_SMALL    1360    /* plus TLS framing, fits a 1460-byte segment with options */
+#define TLS_RAMP            (1024 * 1024)
+#define TLS_IDLE_MS         1000
+
+static SSL_CTX *tls_ctx;            /* for -T legs */
+static const char *tls_name;        /* -N */
+static unsigned long long tls_ramp = TLS_RAMP;
+
+/* log what OpenSSL has queued about a failure */
+static void tls_log(const char *what)
+{
+    char buf[256];
+    unsigned long e;
+
+    if (!(e = ERR_get_error()))
+        log_msg("%s failed", what);
+    for (; e; e = ERR_get_error())
+    {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        log_msg("%s: %s", what, buf);
+    }
+}
+
+/* what client and server contexts have in common */
+static void tls_ctx_setup(SSL_CTX *ctx)
+{
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (trim_ms)
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* a peer closing TCP without close_notify ends the leg like any EOF */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+}
+
+static int tls_init(const char *cafile)
+{
+    OPENSSL_init_ssl(0, NULL);
+    if (!(tls_ctx = SSL_CTX_new(TLS_client_method())))
+    {
+        tls_log("SSL_CTX_new");
+        return -1;
+    }
+    tls_ctx_setup(tls_ctx);
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    if ((cafile ? SSL_CTX_load_verify_locations(tls_ctx, cafile, NULL)
+                : SSL_CTX_set_default_verify_paths(tls_ctx)) != 1)
+    {
+        tls_log(cafile ? cafile : "trust store");
+        return -1;
+    }
+    return 0;
+}
+
+static void set_would_block(void)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    WSASetLastError(WSAEWOULDBLOCK);
+#else
+    errno = EAGAIN;
+#endif
+}
+
+/* map a failed SSL_read/SSL_write on leg i to what recv()/send() would give */
+static int tls_result(struct pair *p, int i, int n)
+{
+    switch (SSL_get_error(p->ssl[i], n))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        set_would_block();
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        return n == 0 ? 0 : -1;
+    default:
+        tls_log("TLS");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/* pick the record size for what leg i sends next */
+static void tls_size(struct pair *p, int i)
+{
+    if (clock_now_ms() - p->tls_last[i] >= TLS_IDLE_MS)
+        p->tls_sent[i] = 0;
+    /* a retried SSL_write must not get less than it was first given */
+    if (!p->tls_retry[i])
+        p->tls_small[i] = p->tls_sent[i] < p->tls_ramp[i];
+}
+
+static int tls_ready;                /* some leg to be read has bytes inside OpenSSL */
+
+/* whether leg i has bytes to read that its socket will not announce */
+static int leg_pending(struct pair *p, int i)
+{
+    return p->ssl[i] && !p->handshake[i] && SSL_has_pending(p->ssl[i]);
+}
+
+/* 0 if a leg must be read without waiting, -1 otherwise */
+static long tls_next_wakeup(void)
+{
+    return tls_ready ? 0 : -1;
+}
+
+static int leg_recv(struct pair *p, int i, char *buf, size_t len)
+{
+    int n;
+
+    if (!p->ssl[i])
+        return recv(p->fd[i], buf, len, 0);
+    if ((n = SSL_read(p->ssl[i], buf, (int) len)) > 0)
+        return n;
+    return tls_result(p, i, n);
+}
+
+static int leg_send(struct pair *p, int i, const char *buf, size_t len)
+{
+    size_t done = 0, chunk;
+    int n;
+
+    if (!p->ssl[i])
+        return send(p->wfd[i], buf, len, 0);
+    do
+    {
+        tls_size(p, i);
+        chunk = len - done;
+        if (p->tls_small[i] && chunk > TLS_RECORD_SMALL)
+            chunk = TLS_RECORD_SMALL;
+        if ((n = SSL_write(p->ssl[i], buf + done, (int) chunk)) <= 0)
+        {
+            p->tls_retry[i] = 1;
+            return done ? (int) done : tls_result(p, i, n);
+        }
+        p->tls_retry[i] = 0;
+        p->tls_sent[i] += n;
+        p->tls_last[i] = clock_now_ms();
+        done += n;
+    } while (done < len && p->tls_small[i]);
+    return (int) done;
+}
+
+/* done with the TLS side of leg i, before its socket is closed */
+static void tls_close(struct pair *p, int i)
+{
+    if (!p->ssl[i])
+        return;
+    if (!p->handshake[i])
+        SSL_shutdown(p->ssl[i]);    /* one try at close_notify, the socket goes anyway */
+    SSL_free(p->ssl[i]);
+    p->ssl[i] = NULL;
+    p->handshake[i] = 0;
+}
+
+/*
+ * TLS termination and SNI routing.
+ *
+ * With -E ROUTEFILE leg one is the server end of a TLS connection: the
+ * client whose bytes arrive over it is answered with the certificate for
+ * the name it asked for, and leg two is held back until the handshake
+ * is done and then connected to the backend routed for that name and
+ * the application protocol agreed by ALPN.  One line per route:
+ *
+ *   NAME CERTFILE KEYFILE HOST PORT [ALPN[,ALPN...]]
+ *
+ * NAME is a server name, "*.domain" for any one label below domain or
+ * "*" for anything, including clients that send no name.  HOST can be a
+ * backend list as for remotehost2, and the server name is then the key
+ * that picks from it.  The first route that fits wins; a name that fits
+ * several routes offers the protocols of all of them, and routes without
+ * ALPN take clients that agreed on none.  A client no route fits gets
+ * the first route's certificate and goes to remotehost2.
+ *
+ * The client may be long in coming, as when leg one is the outgoing end
+ * of a reverse tunnel, so leg one waits for its first bytes without a
+ * deadline or a connect slot, and only the handshake that follows has
+ * to finish within the connect timeout.
+ */
+#define MAX_ROUTES      64
+#define ROUTE_ALPN      128         /* ALPN protocol list, wire format */
+
+static struct route
+{
+    char name[256];
+    char host[POOL_SPEC];           /* single backend, for -T to check its certificate */
+    SSL_CTX *ctx;
+    struct sockaddr_in addr;
+    int pool;                       /* backend list, -1 for a single one */
+    unsigned char alpn[ROUTE_ALPN];
+    unsigned int alpn_len;
+} routes[MAX_ROUTES];
+static int nroutes;
+
+static int route_name_fits(const struct route *r, const char *name)
+{
+    const char *dot;
+
+    if (!strcmp(r->name, "*"))
+        return 1;
+    if (!name)
+        return 0;
+    if (r->name[0] == '*' && r->name[1] == '.')
+        return (dot = strchr(name, '.')) && dot > name && !strcasecmp(dot, r->name + 1);
+    return !strcasecmp(name, r->name);
+}
+
+/* whether wire-format ALPN list has protocol proto */
+static int alpn_has(const unsigned char *list, unsigned int len, const unsigned char *proto, unsigned int plen)
+{
+    unsigned int o;
+
+    for (o = 0; o < len; o += 1 + list[o])
+        if (list[o] == plen && !memcmp(list + o + 1, proto, plen))
+            return 1;
+    return 0;
+}
+
+/* route for a handshake that ended with this name and protocol, NULL if none */
+static struct route *route_find(const char *name, const unsigned char *proto, unsigned int plen)
+{
+    int k;
+
+    for (k = 0; k < nroutes; ++k)
+        if (route_name_fits(&routes[k], name)
+            && (plen ? alpn_has(routes[k].alpn, routes[k].alpn_len, proto, plen) : !routes[k].alpn_len))
+            return &routes[k];
+    return NULL;
+}
+
+/* ClientHello named a server: answer with its certificate */
+static int route_sni(SSL *ssl, int *alert, void *arg)
+{
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    int k;
+
+    (void) alert;
+    (void) arg;
+    for (k = 0; k < nroutes; ++k)
+        if (route_name_fits(&routes[k], name))
+        {
+            SSL_set_SSL_CTX(ssl, routes[k].ctx);
+            break;
+        }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/* pick a protocol the client offers from the routes for its name */
+static int route_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                      const unsigned char *in, unsigned int inlen, void *arg)
+{
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    unsigned int o;
+    int k;
+
+    (void) arg;
+    for (k = 0; k < nroutes; ++k)
+    {
+        if (!routes[k].alpn_len || !route_name_fits(&routes[k], name))
+            continue;
+        /* the client's preference among what this route speaks */
+        for (o = 0; o < inlen && o + 1 + in[o] <= inlen; o += 1 + in[o])
+            if (alpn_has(routes[k].alpn, routes[k].alpn_len, in + o + 1, in[o]))
+            {
+                *out = in + o + 1;
+                *outlen = in[o];
+                return SSL_TLSEXT_ERR_OK;
+            }
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+/* one line of the route file */
+static int route_add(const char *file, int line, char *spec)
+{
+    char *f[7], *save = NULL, *proto;
+    struct route *r;
+    size_t n;
+    int nf = 0;
+
+    for (f[0] = strtok_r(spec, " \t\r\n", &save); f[nf] && nf < 6; )
+        f[++nf] = strtok_r(NULL, " \t\r\n", &save);
+    if (!nf || f[0][0] == '#')
+        return 0;
+    if (nf < 5 || f[nf])
+    {
+        log_msg("%s:%d: want NAME CERTFILE KEYFILE HOST PORT [ALPN,...]", file, line);
+        return -1;
+    }
+    if (nroutes == MAX_ROUTES)
+    {
+        log_msg("%s:%d: too many routes", file, line);
+        return -1;
+    }
+    r = &routes[nroutes];
+    bzero(r, sizeof(*r));
+    if (strlen(f[0]) >= sizeof(r->name) || strlen(f[3]) >= sizeof(r->host))
+    {
+        log_msg("%s:%d: name too long", file, line);
+        return -1;
+    }
+    strcpy(r->name, f[0]);
+    strcpy(r->host, f[3]);
+    for (proto = nf == 6 ? strtok_r(f[5], ",", &save) : NULL; proto; proto = strtok_r(NULL, ",", &save))
+    {
+        if ((n = strlen(proto)) > 255 || r->alpn_len + 1 + n > sizeof(r->alpn))
+        {
+            log_msg("%s:%d: ALPN list too long", file, line);
+            return -1;
+        }
+        r->alpn[r->alpn_len++] = (unsigned char) n;
+        memcpy(r->alpn + r->alpn_len, proto, n);
+        r->alpn_len += n;
+    }
+    r->pool = -1;
+    if (strchr(f[3], ',') ? (r->pool = pool_get(f[3], f[4])) < 0 : resolve(f[3], f[4], &r->addr))
+        return -1;
+    if (!(r->ctx = SSL_CTX_new(TLS_server_method())))
+    {
+        tls_log("SSL_CTX_new");
+        return -1;
+    }
+    tls_ctx_setup(r->ctx);
+    SSL_CTX_set_tlsext_servername_callback(r->ctx, route_sni);
+    SSL_CTX_set_alpn_select_cb(r->ctx, route_alpn, NULL);
+    if (SSL_CTX_use_certificate_chain_file(r->ctx, f[1]) != 1
+        || SSL_CTX_use_PrivateKey_file(r->ctx, f[2], SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(r->ctx) != 1)
+    {
+        tls_log(f[1]);
+        return -1;
+    }
+    ++nroutes;
+    return 0;
+}
+
+static int route_load(const char *path)
+{
+    char spec[1024];
+    FILE *f;
+    int line = 0;
+
+    OPENSSL_init_ssl(0, NULL);
+    if (!(f = fopen(path, "r")))
+    {
+        log_errno(path);
+        return -1;
+    }
+    while (fgets(spec, sizeof(spec), f))
+        if (route_add(path, ++line, spec))
+        {
+            fclose(f);
+            return -1;
+        }
+    fclose(f);
+    if (!nroutes)
+    {
+        log_msg("%s: no routes", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Store-and-forward spool.
+ *
+ * With -S DIR, what arrives on leg one and cannot go out on leg two right
+ * away -- leg two is down, still connecting, or slower than leg one -- is
+ * appended to a spool on disk instead of holding up the sender, and is
+ * drained in order once leg two takes it again.  Leg two is reconnected
+ * every SPOOL_RETRY_MS while it is down, and a pair whose leg one has
+ * ended stays open until its spool is empty.  Only leg one to leg two is
+ * spooled; the reverse direction is relayed while both legs are up.
+ *
+ * A spool is a series of SPOOL_SEG byte segment files DIR/NAME.SEQ, each
+ * preallocated (so a full disk shows up as an error here, not as SIGBUS
+ * on a page of the mapping) and mapped shared, which makes an append a
+ * memcpy() and lets a drain send straight from the page cache.  The
+ * header of a segment holds its committed length.  Appended data and then
+ * the header are written back with msync() every -F ms, after every append
+ * with -F 0, and whenever a segment fills up.  NAME is derived from the
+ * pair's endpoints, so a restart with the same pair picks up what the
+ * previous process left behind and drains that first.
+ */
+#define SPOOL_SEG       (64 * 1024 * 1024)
+#define SPOOL_MAGIC     "RDPSPOOL"
+#define SPOOL_RETRY_MS  1000
+
+struct spool_hdr
+{
+    char magic[8];
+    unsigned long long len;         /* committed bytes after the header */
+};
+
+#define SPOOL_HDR ((size_t) sizeof(struct spool_hdr))
+
+static const char *spool_dir;
+static int spool_sync_ms = 1000;
+static unsigned long long spool_next_sync;
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+static void spool_path(const struct spool *sp, unsigned int seq, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%s.%u", spool_dir, sp->name, seq);
+}
+
+/* map segment seq, creating it if asked; an existing one must be intact */
+static char *spool_map(const struct spool *sp, unsigned int seq, int create)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    char *map;
+    int fd, err;
+
+    spool_path(sp, seq, path);
+    if ((fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600)) < 0)
+    {
+        log_errno(path);
+        return NULL;
+    }
+    if (create && (err = posix_fallocate(fd, 0, SPOOL_SEG)))
+    {
+        errno = err;
+        log_errno(path);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    if (!create && (fstat(fd, &st) || st.st_size != SPOOL_SEG))
+    {
+        log_msg("%s: not a spool segment", path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, SPOOL_SEG, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_errno("mmap");
+        return NULL;
+    }
+    if (create)
+    {
+        memcpy(((struct spool_hdr *) map)->magic, SPOOL_MAGIC, 8);
+        ((struct spool_hdr *) map)->len = 0;
+        /* make the new file itself survive a crash */
+        if ((fd = open(spool_dir, O_RDONLY)) >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    return map;
+}
+
+/* write back what was appended, then the length that commits it */
+static void spool_sync(struct spool *sp)
+{
+    size_t from;
+
+    if (!sp->wmap || sp->synced == sp->woff)
+        return;
+    from = sp->synced & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+    if (msync(sp->wmap + from, sp->woff - from, MS_SYNC))
+        log_errno("msync");
+    ((struct spool_hdr *) sp->wmap)->len = sp->woff - SPOOL_HDR;
+    if (msync(sp->wmap, SPOOL_HDR, MS_SYNC))
+        log_errno("msync");
+    sp->synced = sp->woff;
+}
+
+/* a full segment is final, appends go on in the next one */
+static void spool_seal(struct spool *sp)
+{
+    spool_sync(sp);
+    if (sp->rmap != sp->wmap)
+        munmap(sp->wmap, SPOOL_SEG);
+    else
+        sp->rlen = sp->woff;        /* the drain keeps the mapping */
+    sp->wmap = NULL;
+    ++sp->wseq;
+}
+
+static int spool_append(struct spool *sp, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len)
+    {
+        if (!sp->wmap)
+        {
+            if (!(sp->wmap = spool_map(sp, sp->wseq, 1)))
+                return -1;
+            sp->woff = sp->synced = SPOOL_HDR;
+        }
+        n = SPOOL_SEG - sp->woff < len ? SPOOL_SEG - sp->woff : len;
+        memcpy(sp->wmap + sp->woff, data, n);
+        sp->woff += n;
+        sp->bytes += n;
+        data += n;
+        len -= n;
+        if (sp->woff == SPOOL_SEG)
+            spool_seal(sp);
+    }
+    if (!spool_sync_ms)
+        spool_sync(sp);
+    return 0;
+}
+
+/* the oldest spooled bytes, NULL if there are none */
+static const char *spool_peek(struct spool *sp, size_t *len)
+{
+    char path[PATH_MAX];
+
+    while (sp->bytes)
+    {
+        if (!sp->rmap && sp->rseq == sp->wseq)
+        {
+            if (!sp->wmap)
+            {
+                sp->bytes = 0;      /* only lost segments were left */
+                break;
+            }
+            sp->rmap = sp->wmap;
+            sp->roff = SPOOL_HDR;
+        }
+        else if (!sp->rmap)
+        {
+            if (!(sp->rmap = spool_map(sp, sp->rseq, 0)))
+            {
+                log_msg("spool %s: segment %u lost", sp->name, sp->rseq++);
+                continue;
+            }
+            sp->rlen = SPOOL_HDR + ((struct spool_hdr *) sp->rmap)->len;
+            sp->roff = SPOOL_HDR;
+        }
+        *len = (sp->rseq == sp->wseq ? sp->woff : sp->rlen) - sp->roff;
+        if (*len)
+            return sp->rmap + sp->roff;
+
+        /* a sealed segment has been drained */
+        if (sp->rmap != sp->wmap)
+            munmap(sp->rmap, SPOOL_SEG);
+        sp->rmap = NULL;
+        spool_path(sp, sp->rseq++, path);
+        unlink(path);
+    }
+    return NULL;
+}
+
+static void spool_consume(struct spool *sp, size_t len)
+{
+    sp->roff += len;
+    sp->bytes -= len;
+}
+
+/*
+ * Name the spool of a new pair after its endpoints and take over any
+ * segments an earlier process left under that name.
+ */
+static int spool_open(struct pair *p, char *host[2], char *port[2])
+{
+    struct spool *sp = &p->spool;
+    char spec[4 * POOL_SPEC], path[PATH_MAX];
+    struct spool_hdr hdr;
+    struct dirent *de;
+    unsigned int h, seq;
+    size_t nlen;
+    char *end;
+    DIR *dir;
+    int id, k, fd, found = 0;
+
+    snprintf(spec, sizeof(spec), "%s:%s>%s:%s", host[0], port[0], host[1], port[1]);
+    h = hash_str(spec);
+    for (k = 0;; ++k)
+    {
+        snprintf(sp->name, sizeof(sp->name), "%08x-%d", h, k);
+        for (id = 0; id < MAX_PAIRS; ++id)
+            if (pairs[id].used && !strcmp(pairs[id].spool.name, sp->name))
+                break;
+        if (id == MAX_PAIRS)
+            break;
+    }
+
+    if (!(dir = opendir(spool_dir)))
+    {
+        log_errno(spool_dir);
+        return -1;
+    }
+    nlen = strlen(sp->name);
+    while ((de = readdir(dir)))
+    {
+        if (strncmp(de->d_name, sp->name, nlen) || de->d_name[nlen] != '.')
+            continue;
+        seq = strtoul(de->d_name + nlen + 1, &end, 10);
+        if (*end)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", spool_dir, de->d_name);
+        if ((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && !memcmp(hdr.magic, SPOOL_MAGIC, 8)
+            && hdr.len <= SPOOL_SEG - SPOOL_HDR)
+        {
+            if (!found++ || seq < sp->rseq)
+                sp->rseq = seq;
+            if (seq >= sp->wseq)
+                sp->wseq = seq + 1;
+            sp->bytes += hdr.len;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    if (found)
+        log_msg("pair %d: %llu bytes left in spool %s, draining them first",
+                (int) (p - pairs), sp->bytes, sp->name);
+    return 0;
+}
+
+/* unmap the spool, and remove it unless it still holds data */
+static void spool_close(struct pair *p)
+{
+    struct spool *sp = &p->spool;
+    char path[PATH_MAX];
+    unsigned int seq;
+
+    spool_sync(sp);
+    if (sp->rmap && sp->rmap != sp->wmap)
+        munmap(sp->rmap, SPOOL_SEG);
+    if (sp->wmap)
+        munmap(sp->wmap, SPOOL_SEG);
+    sp->rmap = sp->wmap = NULL;
+    if (sp->bytes)
+    {
+        log_msg("pair %d: %llu bytes kept in spool %s", (int) (p - pairs), sp->bytes, sp->name);
+        return;
+    }
+    for (seq = sp->rseq; seq <= sp->wseq; ++seq)
+    {
+        spool_path(sp, seq, path);
+        unlink(path);
+    }
+}
+#else
+static int spool_open(struct pair *p, char *host[2], char *port[2])
+{
+    (void) p; (void) host; (void) port;
+    return -1;
+}
+
+static int spool_append(struct spool *sp, const char *data, size_t len)
+{
+    (void) sp; (void) data; (void) len;
+    return -1;
+}
+
+static const char *spool_peek(struct spool *sp, size_t *len)
+{
+    (void) sp; (void) len;
+    return NULL;
+}
+
+static void spool_consume(struct spool *sp, size_t len) { (void) sp; (void) len; }
+static void spool_sync(struct spool *sp) { (void) sp; }
+static void spool_close(struct pair *p) { (void) p; }
+#endif
+
+/* periodic write-back for -F */
+static void spool_run(void)
+{
+    int id;
+
+    if (!spool_dir || !spool_sync_ms || clock_now_ms() < spool_next_sync)
+        return;
+    spool_next_sync = clock_now_ms() + spool_sync_ms;
+    for (id = 0; id < MAX_PAIRS; ++id)
+        if (pairs[id].used && pairs[id].spool.name[0])
+            spool_sync(&pairs[id].spool);
+}
+
+/* ms until the next write-back, -1 if none is needed */
+static long spool_next_wakeup(void)
+{
+    if (!spool_dir || !spool_sync_ms || !npairs)
+        return -1;
+    return spool_next_sync > clock_now_ms() ? (long) (spool_next_sync - clock_now_ms()) : 0;
+}
+
+/*
+ * Instance links.
+ *
+ * Two revdatapipe instances can run leg two as a link between them that
+ * carries frames instead of raw bytes: a 4-byte header (type, flags, and a
+ * 16-bit big-endian payload length) followed by at most LINK_FRAME_MAX
+ * payload bytes.  Features that need both ends to cooperate are built as
+ * frame types on top of it.
+ */
+#define LINK_HDR        4
+#define LINK_FRAME_MAX  16384
+#define LINK_BUF        (4 * (LINK_HDR + LINK_FRAME_MAX))
+
+enum link_frame
+{
+    LINK_HELLO = 1,                 /* session id, bytes received so far, -D size, -Z sum */
+    LINK_DATA,                      /* stream offset, then the bytes from there */
+    LINK_ACK,                       /* bytes received so far */
+    LINK_FIN                        /* the sender's leg one has ended at this offset */
+};
+
+static void put64(unsigned char *b, unsigned long long v)
+{
+    int i;
+
+    for (i = 7; i >= 0; --i, v >>= 8)
+        b[i] = (unsigned char) v;
+}
+
+static unsigned long long get64(const unsigned char *b)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 0; i < 8; ++i)
+        v = v << 8 | b[i];
+    return v;
+}
+
+static void put32(unsigned char *b, unsigned int v)
+{
+    b[0] = (unsigned char) (v >> 24);
+    b[1] = (unsigned char) (v >> 16);
+    b[2] = (unsigned char) (v >> 8);
+    b[3] = (unsigned char) v;
+}
+
+static unsigned int get32(const unsigned char *b)
+{
+    return (unsigned int) b[0] << 24 | (unsigned int) b[1] << 16 | (unsigned int) b[2] << 8 | b[3];
+}
+
+/*
+ * Stream coding: WAN deduplication and compression.
+ *
+ * With -D MB (on both ends of a session link) the stream from leg one is
+ * cut into chunks by content (FastCDC: a Gear rolling hash with
+ * normalized chunking around DEDUP_AVG), and a chunk the peer has seen
+ * recently goes out as a reference into its chunk cache instead of the
+ * bytes.  The cache is an MB-megabyte ring per session on the receiving
+ * end, filled with every literal chunk in stream order; the sender keeps
+ * only an index of SHA-256 digests into its own image of that ring.  Both
+ * ends place chunks the same way, so they agree on what is still cached
+ * without talking about it.
+ *
+ * With -C LEVEL (on both ends too) every literal piece, a dedup chunk or
+ * else whatever leg one delivered in one read, is deflated at LEVEL and
+ * flushed on its own, so a small message never waits for more data.  The
+ * compressor keeps its history across pieces for the life of the pair,
+ * and -Z FILE primes that history on both ends with a preset dictionary:
+ * up to 32 KiB of typical traffic (captured messages, the most common
+ * strings last), so that the first messages of a pair compress as well
+ * as the later ones.  HELLO carries the dictionary's Adler-32 to make
+ * sure both ends loaded the same one.
+ *
+ * -C only sets the highest level.  A piece whose sampled bytes look
+ * random (already compressed or encrypted: TLS, media, archives) goes out
+ * as a LIT without passing through deflate.  Once per RATE_WINDOW_MS each
+ * pair's level is stepped down while the process uses more than
+ * CODE_CPU_HIGH percent of a CPU, down to sending everything as LIT, and
+ * back up while its session window is backed up by the link and there is
+ * CPU to spare, so compression is never what limits the throughput.
+ *
+ * The coding is applied to the stream before it enters the session
+ * window, so resends and striping carry coded bytes and each end codes
+ * every byte exactly once.  Coded stream records: LIT (type, 16-bit
+ * length, bytes), REF (type, 16-bit length, 64-bit cache position) and
+ * ZLIT (type, 16-bit length, 16-bit deflated length, deflated bytes).
+ */
+#define DEDUP_MIN       2048
+#define DEDUP_AVG       8192
+#define DEDUP_MAX       16384
+#define DEDUP_MASK_S    0x0003590703530000ULL   /* 15 bits, below DEDUP_AVG */
+#define DEDUP_MASK_L    0x0000d90003530000ULL   /* 11 bits, above it */
+#define DEDUP_DIGEST    16
+#define DEDUP_HOLD_MS   2
+#define CODE_PIECE      DEDUP_MAX       /* largest piece a record carries */
+#define CODE_HDR        3
+#define CODE_REF_LEN    (CODE_HDR + 8)
+#define CODE_ZLIT_HDR   (CODE_HDR + 2)
+#define CODE_SLACK      64              /* most a record adds to its piece, deflate's worst included */
+#define ZDICT_MAX       32768
+#define CODE_SAMPLE     512             /* bytes of a piece looked at for randomness */
+#define CODE_CPU_HIGH   85              /* percent of a CPU where levels go down */
+#define CODE_CPU_LOW    50              /* and under which they may go up again */
+
+enum code_rec
+{
+    CODE_LIT = 1,
+    CODE_REF,
+    CODE_ZLIT
+};
+
+struct dedup_ent
+{
+    unsigned char digest[DEDUP_DIGEST];
+    unsigned long long pos;             /* where the chunk went in the ring, as written */
+    unsigned int len;                   /* 0 if unused */
+};
+
+struct coder
+{
+    unsigned long long size;            /* of the dedup ring, 0 without -D */
+    struct dedup_ent *index;            /* sending side, by digest */
+    size_t nindex;                      /* power of two */
+    unsigned long long tx_written;      /* bytes placed in the peer's ring, padding included */
+    unsigned char *cache;               /* receiving side ring */
+    unsigned long long rx_written;
+    z_stream zout, zin;                 /* with -C */
+    int zready;                         /* both set up */
+    int zlevel, zset;                   /* level wanted (0: pass all as LIT), and set in zout */
+    unsigned long long bypassed;        /* bytes sent as LIT despite -C */
+    unsigned char *cur;                 /* piece being delivered */
+    size_t cur_len, cur_done, cur_rec;  /* its length, progress, and size in the stream */
+    unsigned char piece[CODE_PIECE + 1];            /* inflated, with room for the flush */
+    unsigned char zrec[CODE_PIECE + CODE_SLACK];    /* deflated, out of the ring */
+    unsigned long long raw, coded;      /* bytes in from leg one, and what they coded to */
+    unsigned long long held;            /* ms the uncoded rest of leg one's data was left */
+};
+
+static unsigned int dedup_mb;
+static int compress_level;
+static unsigned char *zdict;
+static size_t zdict_len;
+static unsigned long zdict_sum;         /* Adler-32, also telling HELLO that -C is on */
+static unsigned long long gear[256];
+
+static void gear_init(void)
+{
+    unsigned long long x = 0x9e3779b97f4a7c15ULL, z;
+    int i;
+
+    /* splitmix64, the table only has to be well mixed */
+    for (i = 0; i < 256; ++i)
+    {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* length of the first chunk of p[0..n) */
+static size_t dedup_cut(const unsigned char *p, size_t n)
+{
+    unsigned long long h = 0;
+    size_t i = DEDUP_MIN, normal = DEDUP_AVG, max = DEDUP_MAX;
+
+    if (n <= DEDUP_MIN)
+        return n;
+    if (max > n)
+        max = n;
+    if (normal > max)
+        normal = max;
+    for (; i < normal; ++i)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & DEDUP_MASK_S))
+            return i;
+    }
+    for (; i < max; ++i)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & DEDUP_MASK_L))
+            return i;
+    }
+    return max;
+}
+
+/* where a chunk of len bytes goes in a ring written up to *written; chunks never wrap */
+static unsigned long long dedup_place(const struct coder *d, unsigned long long *written, size_t len)
+{
+    unsigned long long pos = *written;
+
+    if (d->size - pos % d->size < len)
+        pos += d->size - pos % d->size;
+    *written = pos + len;
+    return pos;
+}
+
+/* whether a chunk placed at pos is still whole in a ring written up to written */
+static int dedup_cached(const struct coder *d, unsigned long long written, unsigned long long pos,
+                        size_t len)
+{
+    return pos + len <= written && written <= pos + d->size;
+}
+
+/* load -Z: the last ZDICT_MAX bytes of the file are what deflate can use */
+static int zdict_load(const char *path)
+{
+    FILE *f;
+    long size;
+
+    if (!(f = fopen(path, "rb")))
+    {
+        log_errno(path);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0
+        || fseek(f, size > ZDICT_MAX ? size - ZDICT_MAX : 0, SEEK_SET))
+    {
+        log_errno(path);
+        fclose(f);
+        return -1;
+    }
+    zdict_len = size > ZDICT_MAX ? ZDICT_MAX : (size_t) size;
+    if (!(zdict = malloc(zdict_len + 1)) || fread(zdict, 1, zdict_len, f) != zdict_len)
+    {
+        log_msg("cannot read dictionary %s", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void coder_free(struct coder *d)
+{
+    if (!d)
+        return;
+    if (d->zready)
+    {
+        deflateEnd(&d->zout);
+        inflateEnd(&d->zin);
+    }
+    free(d->index);
+    free(d->cache);
+    free(d);
+}
+
+static struct coder *coder_new(void)
+{
+    struct coder *d;
+
+    if (!(d = calloc(1, sizeof(*d))))
+        return NULL;
+    if (dedup_mb)
+    {
+        if (!gear[0])
+            gear_init();
+        d->size = (unsigned long long) dedup_mb << 20;
+        for (d->nindex = 1024; d->nindex < 2 * d->size / DEDUP_AVG; d->nindex <<= 1)
+            ;
+        if (!(d->index = calloc(d->nindex, sizeof(*d->index))) || !(d->cache = malloc(d->size)))
+        {
+            coder_free(d);
+            return NULL;
+        }
+    }
+    if (compress_level)
+    {
+        if (deflateInit(&d->zout, compress_level) != Z_OK)
+        {
+            coder_free(d);
+            return NULL;
+        }
+        if (inflateInit(&d->zin) != Z_OK)
+        {
+            deflateEnd(&d->zout);
+            coder_free(d);
+            return NULL;
+        }
+        d->zready = 1;
+        d->zlevel = d->zset = compress_level;
+        if (zdict && deflateSetDictionary(&d->zout, zdict, (uInt) zdict_len) != Z_OK)
+        {
+            coder_free(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+/*
+ * Whether a piece looks incompressible: its sampled bytes have a
+ * collision entropy above 7 bits, which text, markup and most binary
+ * formats stay far below.
+ */
+static int coder_random(const unsigned char *data, size_t len)
+{
+    unsigned int count[256] = { 0 };
+    unsigned long long sum = 0;
+    size_t i, n = 0, step = len / CODE_SAMPLE + 1;
+
+    if (len < CODE_SAMPLE / 2)
+        return 0;                   /* a small message gains more from the history */
+    for (i = 0; i < len; i += step, ++n)
+        sum += 2 * count[data[i]]++ + 1;
+    return sum * 128 < (unsigned long long) n * n;
+}
+
+/* CPU time the process has used, in microseconds */
+static unsigned long long cpu_time_us(void)
+{
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    FILETIME created, exited, kernel, user;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+        return 0;
+    return (((unsigned long long) kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+            + ((unsigned long long) user.dwHighDateTime << 32 | user.dwLowDateTime)) / 10;
+#else
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+           + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
+
+/* percent of a CPU the process used since the last call at least a rate window ago */
+static unsigned int cpu_percent(void)
+{
+    static unsigned long long at, used;
+    static unsigned int percent;
+    unsigned long long now;
+
+    if (clock_now_us() - at >= RATE_WINDOW_MS * 1000ULL)
+    {
+        now = cpu_time_us();
+        if (at)
+            percent = (unsigned int) ((now - used) * 100 / (clock_now_us() - at));
+        at = clock_now_us();
+        used = now;
+    }
+    return percent;
+}
+
+/*
+ * Step the level of one pair after a rate window: down while the process
+ * is short of CPU, up while the link rather than the CPU holds the pair
+ * back (linkbound).  Deflate is not timed piece by piece, which would put
+ * clock reads back on the relay path; the process's CPU time per window
+ * covers it.
+ */
+static void coder_tune(struct coder *d, int linkbound)
+{
+    unsigned int cpu = cpu_percent();
+
+    if (!d->zready)
+        return;
+    if (cpu > CODE_CPU_HIGH && d->zlevel > 0)
+        --d->zlevel;
+    else if (cpu < CODE_CPU_LOW && linkbound && d->zlevel < compress_level)
+        ++d->zlevel;
+}
+
+/* code one literal piece at out, deflated with -C */
+static size_t coder_lit(struct coder *d, const unsigned char *data, size_t len, unsigned char *out)
+{
+    size_t clen;
+
+    out[1] = (unsigned char) (len >> 8);
+    out[2] = (unsigned char) len;
+    if (!d->zready || !d->zlevel || coder_random(data, len))
+    {
+        if (d->zready)
+            d->bypassed += len;
+        out[0] = CODE_LIT;
+        memcpy(out + CODE_HDR, data, len);
+        return CODE_HDR + len;
+    }
+    d->zout.next_out = out + CODE_ZLIT_HDR;
+    d->zout.avail_out = (uInt) (len + CODE_SLACK - CODE_ZLIT_HDR);
+    if (d->zlevel != d->zset)
+    {
+        d->zout.avail_in = 0;
+        if (deflateParams(&d->zout, d->zlevel, Z_DEFAULT_STRATEGY) == Z_OK)
+            d->zset = d->zlevel;
+    }
+    d->zout.next_in = (Bytef *) data;
+    d->zout.avail_in = (uInt) len;
+    deflate(&d->zout, Z_SYNC_FLUSH);
+    clen = len + CODE_SLACK - CODE_ZLIT_HDR - d->zout.avail_out;
+    out[0] = CODE_ZLIT;
+    out[3] = (unsigned char) (clen >> 8);
+    out[4] = (unsigned char) clen;
+    return CODE_ZLIT_HDR + clen;
+}
+
+/* inflate the ZLIT in zrec, clen bytes of it, into the len bytes of piece */
+static int coder_inflate(struct coder *d, size_t clen, size_t len)
+{
+    int rc;
+
+    d->zin.next_in = d->zrec;
+    d->zin.avail_in = (uInt) clen;
+    d->zin.next_out = d->piece;
+    d->zin.avail_out = (uInt) len + 1;
+    rc = inflate(&d->zin, Z_SYNC_FLUSH);
+    if (rc == Z_NEED_DICT && zdict && inflateSetDictionary(&d->zin, zdict, (uInt) zdict_len) == Z_OK)
+        rc = inflate(&d->zin, Z_SYNC_FLUSH);
+    return rc == Z_OK && !d->zin.avail_in && d->zin.avail_out == 1 ? 0 : -1;
+}
+
+/*
+ * Code data[0..n) into records at out, which must have room for
+ * n + (n / DEDUP_MIN + 1) * CODE_SLACK bytes; returns the bytes written.
+ * With -D, unless flush is set, a last piece that ends without a content
+ * boundary is left for the next call; *used tells how much was taken.
+ */
+static size_t coder_encode(struct coder *d, const unsigned char *data, size_t n, unsigned char *out,
+                           size_t *used, int flush)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    struct dedup_ent *e;
+    size_t len, o = 0;
+
+    for (*used = 0; n; data += len, n -= len, *used += len)
+    {
+        if (!d->size)
+        {
+            len = n < CODE_PIECE ? n : CODE_PIECE;
+            o += coder_lit(d, data, len, out + o);
+            continue;
+        }
+        len = dedup_cut(data, n);
+        if (len == n && n < DEDUP_MAX && !flush)
+            break;
+        e = NULL;
+        if (len >= DEDUP_MIN)
+        {
+            SHA256(data, len, md);
+            e = &d->index[(md[0] | md[1] << 8 | (size_t) md[2] << 16) & (d->nindex - 1)];
+            if (e->len == len && !memcmp(e->digest, md, DEDUP_DIGEST)
+                && dedup_cached(d, d->tx_written, e->pos, len))
+            {
+                out[o] = CODE_REF;
+                out[o + 1] = (unsigned char) (len >> 8);
+                out[o + 2] = (unsigned char) len;
+                put64(out + o + CODE_HDR, e->pos);
+                o += CODE_REF_LEN;
+                continue;
+            }
+        }
+        o += coder_lit(d, data, len, out + o);
+        if (e)
+        {
+            memcpy(e->digest, md, DEDUP_DIGEST);
+            e->len = (unsigned int) len;
+            e->pos = dedup_place(d, &d->tx_written, len);
+        }
+        else
+            dedup_place(d, &d->tx_written, len);
+    }
+    d->raw += *used;
+    d->coded += o;
+    return o;
+}
+
+/*
+ * Sealed links.
+ *
+ * With -K FILE (on both ends of a session link) every connection of the
+ * link is encrypted and authenticated with AES-256-GCM under a key shared
+ * in advance, which between two of our own instances costs far less than
+ * TLS: no certificates, an exchange of salts instead of a handshake, and
+ * records of up to SEAL_RECORD_MAX bytes that take everything queued on
+ * the connection at once, so the 18 bytes a record adds and the cipher
+ * setup per record are spread over many frames and AES-NI works on long
+ * buffers.  Each end starts a connection with SEAL_SALT random bytes in
+ * clear.  The key and nonce base of each direction come from HKDF-SHA256
+ * over the file's contents and both salts, the lower first, labelled with
+ * whether the sender is the end with the lower or the higher salt, so
+ * every connection has keys of its own, nothing recorded from one can be
+ * replayed into another and nothing sent can be echoed back to its
+ * sender; record n of a direction uses the nonce base XOR n.  A peer salt
+ * equal to our own, which only an echo produces, and a record that does
+ * not authenticate (another key, tampering) drop the connection.
+ *
+ * Record: 16-bit length, that many bytes of ciphertext, 16-byte tag; the
+ * length is authenticated as additional data.
+ */
+#define SEAL_SALT       16
+#define SEAL_KEY        32
+#define SEAL_IV         12
+#define SEAL_TAG        16
+#define SEAL_HDR        2
+#define SEAL_RECORD_MAX (LINK_BUF - LINK_HDR - LINK_FRAME_MAX)  /* always fits behind a partial frame */
+#define SEAL_BUF        (SEAL_HDR + SEAL_RECORD_MAX + SEAL_TAG)
+#define PSK_MIN         16
+#define PSK_MAX         4096
+
+struct seal
+{
+    EVP_CIPHER_CTX *tx, *rx;
+    unsigned char salt[SEAL_SALT], peer_salt[SEAL_SALT];
+    unsigned char tx_iv[SEAL_IV], rx_iv[SEAL_IV];
+    unsigned long long tx_seq, rx_seq;
+    int salted;                         /* our salt is queued */
+    int keyed;                          /* the peer's salt arrived */
+    size_t olen, ooff;                  /* obuf[ooff..olen) sealed, still to be sent */
+    size_t ilen;                        /* ibuf[0..ilen) not opened yet */
+    unsigned char obuf[SEAL_BUF], ibuf[SEAL_BUF];
+};
+
+static unsigned char *psk;
+static size_t psk_len;
+
+static int psk_load(const char *path)
+{
+    FILE *f;
+
+    if (!(f = fopen(path, "rb")))
+    {
+        log_errno(path);
+        return -1;
+    }
+    if (!(psk = malloc(PSK_MAX)))
+    {
+        fclose(f);
+        return -1;
+    }
+    psk_len = fread(psk, 1, PSK_MAX, f);
+    fclose(f);
+    if (psk_len < PSK_MIN)
+    {
+        log_msg("key file %s has fewer than %d bytes", path, PSK_MIN);
+        return -1;
+    }
+    return 0;
+}
+
+static void seal_free(struct seal *c)
+{
+    if (!c)
+        return;
+    EVP_CIPHER_CTX_free(c->tx);
+    EVP_CIPHER_CTX_free(c->rx);
+    OPENSSL_cleanse(c, sizeof(*c));
+    free(c);
+}
+
+static struct seal *seal_new(void)
+{
+    struct seal *c;
+
+    if (!(c = calloc(1, sizeof(*c))))
+        return NULL;
+    if (!(c->tx = EVP_CIPHER_CTX_new()) || !(c->rx = EVP_CIPHER_CTX_new()))
+    {
+        seal_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* a new connection: nothing sent or received under the old keys survives */
+static void seal_reset(struct seal *c)
+{
+    c->salted = c->keyed = 0;
+    c->tx_seq = c->rx_seq = 0;
+    c->olen = c->ooff = c->ilen = 0;
+}
+
+/* the key and nonce base for the direction sent by the end with the lower salt if low, else the higher */
+static int seal_derive(const struct seal *c, int low, unsigned char *out)
+{
+    int ours = memcmp(c->salt, c->peer_salt, SEAL_SALT) < 0;
+    const char *info = low ? "revdatapipe seal low" : "revdatapipe seal high";
+    unsigned char salt[2 * SEAL_SALT];
+    EVP_PKEY_CTX *kctx;
+    size_t len = SEAL_KEY + SEAL_IV;
+    int ok;
+
+    memcpy(salt, ours ? c->salt : c->peer_salt, SEAL_SALT);
+    memcpy(salt + SEAL_SALT, ours ? c->peer_salt : c->salt, SEAL_SALT);
+    ok = (kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) && EVP_PKEY_derive_init(kctx) > 0
+         && EVP_PKEY_CTX_set_hkdf_md(kctx, EVP_sha256()) > 0
+         && EVP_PKEY_CTX_set1_hkdf_salt(kctx, salt, sizeof(salt)) > 0
+         && EVP_PKEY_CTX_set1_hkdf_key(kctx, psk, (int) psk_len) > 0
+         && EVP_PKEY_CTX_add1_hkdf_info(kctx, (const unsigned char *) info, (int) strlen(info)) > 0
+         && EVP_PKEY_derive(kctx, out, &len) > 0;
+    EVP_PKEY_CTX_free(kctx);
+    return ok ? 0 : -1;
+}
+
+static int seal_keys(struct seal *c)
+{
+    unsigned char km[SEAL_KEY + SEAL_IV];
+    int low = memcmp(c->salt, c->peer_salt, SEAL_SALT) < 0, ok;
+
+    ok = !seal_derive(c, low, km)
+         && EVP_EncryptInit_ex(c->tx, EVP_aes_256_gcm(), NULL, km, NULL) == 1;
+    memcpy(c->tx_iv, km + SEAL_KEY, SEAL_IV);
+    ok = ok && !seal_derive(c, !low, km)
+         && EVP_DecryptInit_ex(c->rx, EVP_aes_256_gcm(), NULL, km, NULL) == 1;
+    memcpy(c->rx_iv, km + SEAL_KEY, SEAL_IV);
+    OPENSSL_cleanse(km, sizeof(km));
+    c->keyed = ok;
+    return ok ? 0 : -1;
+}
+
+static void seal_nonce(const unsigned char *iv, unsigned long long seq, unsigned char *nonce)
+{
+    int i;
+
+    memcpy(nonce, iv, SEAL_IV);
+    for (i = SEAL_IV - 1; i >= SEAL_IV - 8; --i, seq >>= 8)
+        nonce[i] ^= (unsigned char) seq;
+}
+
+/* seal data[0..n), at most SEAL_RECORD_MAX bytes, as a record at the end of obuf */
+static int seal_record(struct seal *c, const unsigned char *data, size_t n)
+{
+    unsigned char nonce[SEAL_IV], *r = c->obuf + c->olen;
+    int len;
+
+    r[0] = (unsigned char) (n >> 8);
+    r[1] = (unsigned char) n;
+    seal_nonce(c->tx_iv, c->tx_seq++, nonce);
+    if (EVP_EncryptInit_ex(c->tx, NULL, NULL, NULL, nonce) != 1
+        || EVP_EncryptUpdate(c->tx, NULL, &len, r, SEAL_HDR) != 1
+        || EVP_EncryptUpdate(c->tx, r + SEAL_HDR, &len, data, (int) n) != 1
+        || EVP_EncryptFinal_ex(c->tx, r + SEAL_HDR + len, &len) != 1
+        || EVP_CIPHER_CTX_ctrl(c->tx, EVP_CTRL_GCM_GET_TAG, SEAL_TAG, r + SEAL_HDR + n) != 1)
+        return -1;
+    c->olen += SEAL_HDR + n + SEAL_TAG;
+    return 0;
+}
+
+/*
+ * Open the first record in ibuf into out, which has room for
+ * SEAL_RECORD_MAX bytes; returns its length, 0 if it has not all arrived,
+ * -1 if it does not authenticate.
+ */
+static int seal_open(struct seal *c, unsigned char *out)
+{
+    unsigned char nonce[SEAL_IV], *r = c->ibuf;
+    size_t n;
+    int len;
+
+    if (c->ilen < SEAL_HDR)
+        return 0;
+    if ((n = (size_t) r[0] << 8 | r[1]) > SEAL_RECORD_MAX || !n)
+        return -1;
+    if (c->ilen < SEAL_HDR + n + SEAL_TAG)
+        return 0;
+    seal_nonce(c->rx_iv, c->rx_seq++, nonce);
+    if (EVP_DecryptInit_ex(c->rx, NULL, NULL, NULL, nonce) != 1
+        || EVP_DecryptUpdate(c->rx, NULL, &len, r, SEAL_HDR) != 1
+        || EVP_DecryptUpdate(c->rx, out, &len, r + SEAL_HDR, (int) n) != 1
+        || EVP_CIPHER_CTX_ctrl(c->rx, EVP_CTRL_GCM_SET_TAG, SEAL_TAG, r + SEAL_HDR + n) != 1
+        || EVP_DecryptFinal_ex(c->rx, out + len, &len) != 1)
+        return -1;
+    c->ilen -= SEAL_HDR + n + SEAL_TAG;
+    memmove(c->ibuf, c->ibuf + SEAL_HDR + n + SEAL_TAG, c->ilen);
+    return (int) n;
+}
+
+/*
+ * Resumable sessions.
+ *
+ * With -s, leg two is a link to another revdatapipe (run with -s too,
+ * typically joined to it through a relay both connect to) and losing it
+ * no longer ends the pair.  Every byte from leg one is kept in a
+ * SESSION_WINDOW ring until the peer acknowledges it.  When the link
+ * drops it is reconnected every SESSION_RETRY_MS; both ends then send a
+ * HELLO with their session id and how many bytes they have received, and
+ * each resends from the point the other reached.  The application
+ * connections on leg one stay up throughout.  A pair whose link stays
+ * down for SESSION_TIMEOUT_MS, or whose peer comes back with another
+ * session id (it restarted), is closed.  An ending leg one is passed on
+ * as FIN once all its bytes are acknowledged, and closes the peer's pair.
+ *
+ * With -p N the link is striped over N parallel connections ("paths") to
+ * the same address, so that one tunnel is not limited to the window of
+ * a single TCP flow.  Path 0 is leg two itself; the others are connected
+ * by the session, outside the connect scheduler.  Each DATA frame carries
+ * its stream offset and goes to the path with the least queued per byte/s
+ * it has been moving, which shifts the stripe towards the faster paths.
+ * The receiver puts frames back in order in a second window-sized ring.
+ * A path that drops has everything unacknowledged resent over the others.
+ */
+#define SESSION_WINDOW      (1024 * 1024)   /* power of two */
+#define SESSION_RETRY_MS    1000
+#define SESSION_TIMEOUT_MS  60000
+#define SESSION_ACK_MS      100
+#define SESSION_PATHS_MAX   16
+#define SESSION_RANGES      64
+
+/* one connection of a session link */
+struct link
+{
+    SOCKET fd;                          /* paths past 0 only, path 0 is leg two */
+    int state;                          /* likewise, LEG_* */
+    unsigned long long when;            /* as pair.when */
+    int hello;                          /* the peer's HELLO arrived on this connection */
+    int hello_due;
+    size_t ilen;                        /* ibuf[0..ilen) not parsed yet */
+    size_t olen, ooff;                  /* obuf[ooff..olen) still to be sent */
+    unsigned long long win_sent, rate;  /* bytes sent this rate window, bytes/s in the last */
+    struct seal *seal;                  /* with -K */
+    unsigned char ibuf[LINK_BUF], obuf[LINK_BUF];
+};
+
+struct session
+{
+    unsigned long long id, peer;        /* session ids of both ends, peer 0 until known */
+    unsigned long long down_since;      /* ms no path had the peer's HELLO since, 0 if one has */
+    int npaths;
+    struct link *links;
+    int ack_due, fin_sent, fin_seen;
+    unsigned long long fin_at;          /* end of the peer's stream, ~0 until its FIN */
+    unsigned long long win_start;
+    char *ring;                         /* leg one's bytes from snd_una to snd_end */
+    unsigned long long snd_una, snd_nxt, snd_max, snd_end;
+    char *rring;                        /* the peer's bytes from rcvd on, by stream offset */
+    struct { unsigned long long start, end; } ranges[SESSION_RANGES];
+    int nranges;                        /* received stretches of rring, sorted */
+    unsigned long long rcvd, acked;     /* delivered to leg one, and acknowledged to the peer */
+    unsigned long long ack_at;          /* ms the last ACK went out */
+    int iblocked;                       /* leg one is full */
+    struct coder *cd;                   /* NULL without -D and -C */
+};
+
+static int session_mode;
+static int session_paths = 1;
+
+static void sess_free(struct session *s)
+{
+    int k;
+
+    if (!s)
+        return;
+    for (k = 1; k < s->npaths; ++k)
+        if (s->links[k].fd != INVALID_SOCKET)
+            closesocket(s->links[k].fd);
+    for (k = 0; k < s->npaths; ++k)
+        seal_free(s->links[k].seal);
+    free(s->links);
+    free(s->ring);
+    free(s->rring);
+    coder_free(s->cd);
+    free(s);
+}
+
+static struct session *sess_new(void)
+{
+    struct session *s;
+    int k;
+
+    if (!(s = calloc(1, sizeof(*s))))
+    {
+        log_msg("out of memory for session");
+        return NULL;
+    }
+    if (!(s->links = calloc(session_paths, sizeof(*s->links))) || !(s->ring = malloc(SESSION_WINDOW))
+        || !(s->rring = malloc(SESSION_WINDOW)) || ((dedup_mb || compress_level) && !(s->cd = coder_new())))
+    {
+        sess_free(s);               /* npaths is still 0 */
+        log_msg("out of memory for session");
+        return NULL;
+    }
+    while (!s->id)
+        if (RAND_bytes((unsigned char *) &s->id, sizeof(s->id)) != 1)
+            s->id = ((unsigned long long) rand() << 32) ^ rand() ^ clock_now_ms();
+    s->npaths = session_paths;
+    for (k = 0; k < s->npaths && psk; ++k)
+        if (!(s->links[k].seal = seal_new()))
+        {
+            sess_free(s);
+            log_msg("out of memory for session");
+            return NULL;
+        }
+    s->down_since = clock_now_ms();
+    s->fin_at = ~0ULL;
+    s->win_start = clock_now_ms();
+    for (k = 1; k < s->npaths; ++k)
+    {
+        s->links[k].fd = INVALID_SOCKET;
+        s->links[k].state = LEG_QUEUED;
+        s->links[k].when = clock_now_ms();
+    }
+    return s;
+}
+
+/* path k (re)connected: start over on it with a HELLO */
+static void sess_path_up(struct session *s, int k)
+{
+    struct link *l = &s->links[k];
+
+    l->hello = 0;
+    l->hello_due = 1;
+    l->ilen = l->olen = l->ooff = 0;
+    if (l->seal)
+        seal_reset(l->seal);
+}
+
+/* path k is gone, whatever went out on it may be lost */
+static void sess_path_down(struct session *s, int k)
+{
+    struct link *l = &s->links[k];
+    int j;
+
+    /* what was queued on it goes again from the session window */
+    l->olen = l->ooff = 0;
+    if (l->seal)
+        seal_reset(l->seal);
+    if (l->hello)
+    {
+        l->hello = 0;
+        s->snd_nxt = s->snd_una;
+        s->fin_sent = 0;
+    }
+    for (j = 0; j < s->npaths; ++j)
+        if (s->links[j].hello)
+            return;
+    if (!s->down_since)
+        s->down_since = clock_now_ms();
+}
+
+static void leg_set_state(struct pair *p, int i, int state)
+{
+    if (p->state[i] == LEG_QUEUED)
+        --legs_queued;
+    else if (p->state[i] == LEG_CONNECTING)
+        --legs_connecting;
+    if (state == LEG_QUEUED)
+        ++legs_queued;
+    else if (state == LEG_CONNECTING)
+        ++legs_connecting;
+    p->state[i] = state;
+}
+
+/* leg two no longer counts against the pooled backend it was given */
+static void pair_unpick(struct pair *p)
+{
+    if (p->pool < 0)
+        return;
+    --pools[p->pool].backends[p->backend].load;
+    --pools[p->pool].total;
+    p->pool = -1;
+}
+
+static void pair_close(struct pair *p)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        leg_set_state(p, i, LEG_UP);
+        tls_close(p, i);
+        if (p->fd[i] != INVALID_SOCKET)
+            closesocket(p->fd[i]);
+        if (p->wfd[i] != p->fd[i] && p->wfd[i] != INVALID_SOCKET)
+            closesocket(p->wfd[i]);
+    }
+    pair_unpick(p);
+    for (i = 0; i < 2; ++i)
+        relay_buf_drop(p, i);
+    if (p->spool.name[0])
+        spool_close(p);
+    sess_free(p->sess);
+    p->sess = NULL;
+    free(p->tls_host);
+    p->tls_host = NULL;
+    p->used = 0;
+    --npairs;
+}
+
+/*
+ * Set up a new pair and queue both legs for connecting, returns its id or
+ * -1.  key is the session key for pooled backends, NULL for the default.
+ */
+static int pair_open(char *host[2], char *port[2], const char *key)
+{
+    char defkey[POOL_SPEC];
+    const char *name;
+    struct pair *p;
+    int id, i;
+
+    for (id = 0; id < MAX_PAIRS && pairs[id].used; ++id)
+        ;
+    if (id == MAX_PAIRS)
+    {
+        log_msg("pair table full");
+        return -1;
+    }
+    p = &pairs[id];
+    bzero(p, sizeof(*p));
+    p->fd[0] = p->fd[1] = p->wfd[0] = p->wfd[1] = INVALID_SOCKET;
+    p->state[0] = p->state[1] = LEG_UP;
+    p->pool = -1;
+    p->pace[0] = p->pace[1] = pace_default;
+    p->win_start = clock_now_ms();
+    p->bufwant[0] = p->bufwant[1] = RELAY_BUF_MIN;
+    p->tls_ramp[0] = p->tls_ramp[1] = tls_ramp;
+    if (udp_mode)
+    {
+        if (!strcmp(host[0], "-"))
+        {
+            log_msg("stdin/stdout cannot be a UDP leg");
+            goto fail;
+        }
+        p->udp = 1;
+        if (!realtime)
+        {
+            p->bufwant[0] = UDP_BATCH * UDP_SLOT;   /* no TCP_INFO to tune it by */
+            p->bufwant[1] = UDP_BUF_MIN;
+        }
+    }
+    if (strcmp(host[0], "-") && resolve(host[0], port[0], &p->dest[0]))
+        goto fail;
+    if (!strcmp(host[1], "-") || !strchr(host[1], ','))
+    {
+        if (strcmp(host[1], "-") && resolve(host[1], port[1], &p->dest[1]))
+            goto fail;
+    }
+    else
+    {
+        if ((p->pool = pool_get(host[1], port[1])) < 0)
+            goto fail;
+        if (!key)
+        {
+            snprintf(defkey, sizeof(defkey), "%s:%s", host[0], port[0]);
+            key = defkey;
+        }
+        p->backend = pool_pick(&pools[p->pool], key);
+        p->dest[1] = pools[p->pool].backends[p->backend].addr;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        if (strcmp(host[i], "-"))
+            continue;
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        if (!strcmp(host[!i], "-") || stdio_open(p, i))
+#endif
+        {
+            log_msg("cannot use stdin/stdout as a leg here");
+            goto fail;
+        }
+    }
+    if (nroutes && p->stdio[0])
+    {
+        log_msg("stdin/stdout cannot terminate TLS");
+        goto fail;
+    }
+    if (tls_ctx)
+    {
+        if (p->stdio[1])
+        {
+            log_msg("stdin/stdout cannot be a TLS leg");
+            goto fail;
+        }
+        name = tls_name ? tls_name : p->pool >= 0 ? pools[p->pool].backends[p->backend].host : host[1];
+        if (!(p->tls_host = strdup(name)))
+        {
+            log_msg("out of memory");
+            goto fail;
+        }
+    }
+    if (p->udp || tls_ctx || nroutes)
+        p->splice[0] = p->splice[1] = 0;
+    if (session_mode && !p->stdio[1])
+    {
+        if (!(p->sess = sess_new()))
+            goto fail;
+        p->splice[0] = p->splice[1] = 0;
+    }
+    else if (spool_dir && !p->stdio[1])
+    {
+        if (spool_open(p, host, port))
+            goto fail;
+        p->splice[0] = 0;
+    }
+
+    if (!legs_queued && !legs_connecting)
+    {
+        ramp_start = clock_now_ms();
+        ramp_legs = ramp_failed = 0;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        if (p->stdio[i])
+            continue;
+        if (i == 1 && nroutes)
+        {
+            leg_set_state(p, i, LEG_ROUTING);
+            continue;
+        }
+        leg_set_state(p, i, LEG_QUEUED);
+        p->when[i] = clock_now_ms() + (connect_jitter > 0 ? rand() % (connect_jitter + 1) : 0);
+        ++ramp_legs;
+    }
+    p->used = 1;
+    ++npairs;
+    return id;
+
+fail:
+    /* undo what the pair took so far; p->used is still 0 */
+    pair_unpick(p);
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+    stdio_release(p);
+#endif
+    free(p->tls_host);
+    p->tls_host = NULL;
+    return -1;
+}
+
+static void leg_up(struct pair *p, int i)
+{
+    leg_set_state(p, i, LEG_UP);
+    if (i == 1 && p->sess)
+        sess_path_up(p->sess, 0);
+}
+
+/* close leg i and queue it to connect again in delay ms */
+static void leg_requeue(struct pair *p, int i, unsigned long long delay)
+{
+    tls_close(p, i);
+    if (p->fd[i] != INVALID_SOCKET)
+        closesocket(p->fd[i]);
+    p->fd[i] = p->wfd[i] = INVALID_SOCKET;
+    p->blocked[!i] = 0;
+    if (!legs_queued && !legs_connecting)
+    {
+        ramp_start = clock_now_ms();
+        ramp_legs = ramp_failed = 0;
+    }
+    leg_set_state(p, i, LEG_QUEUED);
+    p->when[i] = clock_now_ms() + delay;
+    ++ramp_legs;
+}
+
+/*
+ * Leg i failed or reached EOF, returns -1 if that ends the pair.  A
+ * spooling or session pair reconnects a lost leg two instead, and keeps
+ * passing on what it holds after leg one has ended.
+ */
+static int pair_leg_down(struct pair *p, int i)
+{
+    if (!p->spool.name[0] && !p->sess)
+        return -1;
+    if (i == 0)
+    {
+        if (p->state[0] != LEG_UP)
+            return -1;
+        /* leg two keeps being read so it cannot stall, but goes nowhere */
+        p->eof = 1;
+        p->len[1] = p->off[1] = 0;
+        p->splice[1] = p->blocked[1] = 0;
+        return p->spool.bytes || p->sess ? 0 : -1;
+    }
+    if (p->sess)
+    {
+        log_msg("pair %d: session path 0 down, reconnecting", (int) (p - pairs));
+        sess_path_down(p->sess, 0);
+        leg_requeue(p, 1, SESSION_RETRY_MS);
+        return 0;
+    }
+    log_msg("pair %d: leg two down, spooling", (int) (p - pairs));
+    leg_requeue(p, 1, SPOOL_RETRY_MS);
+    return 0;
+}
+
+static void leg_failed(struct pair *p, int i)
+{
+    log_errno("connect");
+    if (i == 1 && p->pool >= 0)
+        backend_failed(&pools[p->pool].backends[p->backend]);
+    ++ramp_failed;
+    ++connect_failures;
+    if (pair_leg_down(p, i))
+        pair_close(p);
+}
+
+/* number of connects in flight to the same address and port */
+static int dest_inflight(const struct sockaddr_in *sa)
+{
+    int id, i, n = 0;
+
+    for (id = 0; id < MAX_PAIRS; ++id)
+        for (i = 0; i < 2; ++i)
+            if (pairs[id].used && pairs[id].state[i] == LEG_CONNECTING
+                && pairs[id].dest[i].sin_addr.s_addr == sa->sin_addr.s_addr
+                && pairs[id].dest[i].sin_port == sa->sin_port)
+                ++n;
+    return n;
+}
+
+/* leg one's handshake is done: send leg two where its name and protocol go */
+static int pair_route(struct pair *p)
+{
+    const char *name = SSL_get_servername(p->ssl[0], TLSEXT_NAMETYPE_host_name);
+    const unsigned char *proto;
+    unsigned int plen;
+    struct route *r;
+
+    SSL_get0_alpn_selected(p->ssl[0], &proto, &plen);
+    if ((r = route_find(name, proto, plen)))
+    {
+        pair_unpick(p);
+        if (r->pool >= 0)
+        {
+            p->pool = r->pool;
+            p->backend = pool_pick(&pools[p->pool], name ? name : r->name);
+            p->dest[1] = pools[p->pool].backends[p->backend].addr;
+        }
+        else
+            p->dest[1] = r->addr;
+        if (tls_ctx && !tls_name)
+        {
+            free(p->tls_host);
+            p->tls_host = NULL;
+            if (!(p->tls_host = strdup(r->pool >= 0 ? pools[r->pool].backends[p->backend].host : r->host)))
+            {
+                log_msg("out of memory");
+                return -1;
+            }
+        }
+    }
+    if (!legs_queued && !legs_connecting)
+    {
+        ramp_start = clock_now_ms();
+        ramp_legs = ramp_failed = 0;
+    }
+    leg_set_state(p, 1, LEG_QUEUED);
+    p->when[1] = clock_now_ms();
+    ++ramp_legs;
+    return 0;
+}
+
+/* TLS handshake step on connecting leg i */
+static void tls_handshake(struct pair *p, int i)
+{
+    long verify;
+    int n;
+
+    if ((n = SSL_do_handshake(p->ssl[i])) == 1)
+    {
+        p->handshake[i] = 0;
+        leg_up(p, i);
+        if (i == 0 && p->state[1] == LEG_ROUTING && pair_route(p))
+            pair_close(p);
+        return;
+    }
+    switch (SSL_get_error(p->ssl[i], n))
+    {
+    case SSL_ERROR_WANT_READ:
+        p->hs_read[i] = 1;
+        return;
+    case SSL_ERROR_WANT_WRITE:
+        p->hs_read[i] = 0;
+        return;
+    default:
+        if (i == 1 && (verify = SSL_get_verify_result(p->ssl[i])) != X509_V_OK)
+            log_msg("pair %d: certificate: %s", (int) (p - pairs), X509_verify_cert_error_string(verify));
+        tls_log("TLS handshake");
+        errno = EPROTO;
+        leg_failed(p, i);
+    }
+}
+
+/* TCP is up on leg i: up it is, unless TLS has to be set up first */
+static void leg_connected(struct pair *p, int i)
+{
+    SSL_CTX *ctx = i ? tls_ctx : nroutes ? routes[0].ctx : NULL;
+    X509_VERIFY_PARAM *vp;
+
+    if (!ctx)
+    {
+        leg_up(p, i);
+        return;
+    }
+    if (i == 0)
+        leg_set_state(p, i, LEG_HELLO);
+    else
+    {
+        leg_set_state(p, i, LEG_CONNECTING);
+        p->when[i] = clock_now_ms() + CONNECT_TIMEOUT_MS;
+    }
+    p->handshake[i] = 1;
+    p->hs_read[i] = i == 0;             /* a server reads first */
+    p->tls_small[i] = p->tls_retry[i] = 0;
+    p->tls_last[i] = 0;
+    if (!(p->ssl[i] = SSL_new(ctx)) || SSL_set_fd(p->ssl[i], (int) p->fd[i]) != 1)
+    {
+        tls_log("SSL_new");
+        errno = ENOMEM;
+        leg_failed(p, i);
+        return;
+    }
+    if (i == 0)
+        SSL_set_accept_state(p->ssl[i]);    /* whichever end connected, this one serves */
+    else
+        SSL_set_connect_state(p->ssl[i]);
+    if (i == 1 && p->tls_host)
+    {
+        vp = SSL_get0_param(p->ssl[i]);
+        /* an IP literal is checked as an address and sent no SNI, anything else is a name */
+        if (X509_VERIFY_PARAM_set1_ip_asc(vp, p->tls_host) != 1
+            && (!SSL_set_tlsext_host_name(p->ssl[i], p->tls_host)
+                || X509_VERIFY_PARAM_set1_host(vp, p->tls_host, 0) != 1))
+        {
+            tls_log(p->tls_host);
+            errno = EINVAL;
+            leg_failed(p, i);
+            return;
+        }
+        tls_handshake(p, i);
+    }
+}
+
+static void leg_connect(struct pair *p, int i)
+{
+    if ((p->fd[i] = socket(AF_INET, i == 0 && p->udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0) 
+    {
+        log_errno("socket");
+        p->fd[i] = INVALID_SOCKET;
+        ++connect_failures;
+        pair_close(p);
+        return;
+    }
+    p->wfd[i] = p->fd[i];
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+    if (p->fd[i] >= FD_SETSIZE)
+    {
+        log_msg("too many open sockets");
+        ++connect_failures;
+        pair_close(p);
+        return;
+    }
+#endif
+    set_nonblock(p->fd[i], 1);
+    if (p->pace[i])
+        leg_pace(p, i);
+    if (i == 0 && p->udp && udp_bind(p->fd[i]))
+        leg_failed(p, i);
+    else if (connect(p->fd[i], (struct sockaddr *)&p->dest[i], sizeof(p->dest[i])) == 0)
+        leg_connected(p, i);
+    else if (connect_in_progress())
+    {
+        leg_set_state(p, i, LEG_CONNECTING);
+        p->when[i] = clock_now_ms() + CONNECT_TIMEOUT_MS;
+    }
+    else
+        leg_failed(p, i);
+}
+
+/* a connecting leg became ready (writable, or what its handshake waits for) or may have timed out */
+static void leg_check(struct pair *p, int i, int ready)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (ready && p->handshake[i])
+        tls_handshake(p, i);
+    else if (ready)
+    {
+        if (getsockopt(p->fd[i], SOL_SOCKET, SO_ERROR, (char *) &err, &len) == 0 && !err)
+        {
+            leg_connected(p, i);
+            return;
+        }
+        errno = err;
+        leg_failed(p, i);
+    }
+    else if (clock_now_ms() >= p->when[i])
+    {
+        errno = ETIMEDOUT;
+        leg_failed(p, i);
+    }
+}
+
+/* start as many queued legs as the limits allow */
+static void connect_schedule(void)
+{
+    int id, i;
+
+    for (id = 0; id < MAX_PAIRS && legs_queued && legs_connecting < connect_max; ++id)
+    {
+        for (i = 0; i < 2 && pairs[id].used && legs_connecting < connect_max; ++i)
+        {
+            if (pairs[id].state[i] != LEG_QUEUED || pairs[id].when[i] > clock_now_ms()
+                || dest_inflight(&pairs[id].dest[i]) >= connect_per_dest)
+                continue;
+            leg_connect(&pairs[id], i);
+        }
+    }
+    if (ramp_legs && !legs_queued && !legs_connecting)
+    {
+        log_msg("ramp: %u connects (%u failed) in %llu ms", ramp_legs, ramp_failed,
+                clock_now_ms() - ramp_start);
+        ramp_legs = 0;
+    }
+}
+
+/* ms until the scheduler next needs to run without socket activity, -1 if never */
+static long connect_next_wakeup(void)
+{
+    unsigned long long next = 0, now = clock_now_ms();
+    int id, i;
+
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        if (!pairs[id].used)
+            continue;
+        for (i = 0; i < 2; ++i)
+        {
+            /* queued legs that are already due wait for a free slot instead */
+            if (pairs[id].state[i] == LEG_UP || pairs[id].state[i] == LEG_ROUTING || pairs[id].state[i] == LEG_HELLO
+                || (pairs[id].state[i] == LEG_QUEUED && pairs[id].when[i] <= now))
+                continue;
+            if (!next || pairs[id].when[i] < next)
+                next = pairs[id].when[i];
+        }
+    }
+    if (!next)
+        return -1;
+    return next > now ? (long) (next - now) : 0;
+}
+
+/* send what is buffered from leg `from' to the other leg, returns -1 if the pair is done */
+static int pair_flush(struct pair *p, int from)
+{
+    int nbyt;
+
+    while (p->off[from] < p->len[from])
+    {
+        nbyt = leg_send(p, !from, p->buf[from] + p->off[from], p->len[from] - p->off[from]);
+        if (nbyt < 0 && would_block())
+            return 0;
+        if (nbyt <= 0)
+            return pair_leg_down(p, !from);
+        p->off[from] += nbyt;
+    }
+    p->len[from] = p->off[from] = 0;
+    return 0;
+}
+
+/* account for nbyt bytes that arrived on leg `from' */
+static void pair_account(struct pair *p, int from, int nbyt)
+{
+    p->bytes[from] += nbyt;
+    p->win_bytes[from] += nbyt;
+    p->last_rx[from] = clock_now_ms();
+    if (clock_now_ms() - p->win_start >= RATE_WINDOW_MS)
+        rate_roll(p);
+
+    /* time to first response byte from a pooled backend */
+    if (p->pool >= 0 && !p->first_seen)
+    {
+        if (from == 0 && !p->first_sent)
+            p->first_sent = clock_now_ms();
+        else if (from == 1)
+        {
+            p->first_seen = 1;
+            if (p->first_sent && clock_now_ms() - p->first_sent > SLOW_FIRST_BYTE_MS)
+                backend_failed(&pools[p->pool].backends[p->backend]);
+            else
+                backend_ok(&pools[p->pool].backends[p->backend]);
+        }
+    }
+}
+
+/* get buf[from] to the size wanted; buffers are only resized while empty */
+static int pair_buf(struct pair *p, int from)
+{
+    if (!p->buf[from] || p->bufsize[from] != p->bufwant[from])
+    {
+        relay_buf_drop(p, from);
+        if (!(p->buf[from] = relay_buf_get(p->bufwant[from])))
+        {
+            log_msg("out of memory for relay buffer");
+            return -1;
+        }
+        p->bufsize[from] = p->bufwant[from];
+        relay_held += p->bufsize[from];
+    }
+    return 0;
+}
+
+/*
+ * Pass on what leg one of a spooling pair delivered: straight to leg two
+ * while nothing is spooled and it keeps up, into the spool otherwise.
+ */
+static int pair_spool(struct pair *p)
+{
+    if (!p->spool.bytes && p->state[1] == LEG_UP && pair_flush(p, 0))
+        return -1;
+    if (p->off[0] < p->len[0])
+    {
+        if (spool_append(&p->spool, p->buf[0] + p->off[0], p->len[0] - p->off[0]))
+        {
+            log_msg("pair %d: cannot spool", (int) (p - pairs));
+            return -1;
+        }
+        p->len[0] = p->off[0] = 0;
+    }
+    return 0;
+}
+
+/* send spooled data to leg two, returns -1 if the pair is done */
+static int spool_drain(struct pair *p)
+{
+    const char *data;
+    size_t len;
+    int nbyt;
+
+    while ((data = spool_peek(&p->spool, &len)))
+    {
+        nbyt = leg_send(p, 1, data, len);
+        if (nbyt < 0 && would_block())
+            return 0;
+        if (nbyt <= 0)
+            return pair_leg_down(p, 1);
+        spool_consume(&p->spool, nbyt);
+    }
+    return 0;
+}
+
+static SOCKET path_fd(struct pair *p, int k)
+{
+    return k ? p->sess->links[k].fd : p->fd[1];
+}
+
+static int path_up(struct pair *p, int k)
+{
+    return (k ? p->sess->links[k].state : p->state[1]) == LEG_UP;
+}
+
+/* path k failed or hit EOF, returns -1 if that ends the pair */
+static int path_lost(struct pair *p, int k)
+{
+    struct link *l = &p->sess->links[k];
+
+    if (!k)
+        return pair_leg_down(p, 1);
+    log_msg("pair %d: session path %d down, reconnecting", (int) (p - pairs), k);
+    sess_path_down(p->sess, k);
+    if (l->fd != INVALID_SOCKET)
+        closesocket(l->fd);
+    l->fd = INVALID_SOCKET;
+    l->state = LEG_QUEUED;
+    l->when = clock_now_ms() + SESSION_RETRY_MS;
+    return 0;
+}
+
+/* start connecting a further path to where leg two goes */
+static void path_connect(struct pair *p, int k)
+{
+    struct link *l = &p->sess->links[k];
+
+    if ((l->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        l->fd = INVALID_SOCKET;
+        path_lost(p, k);
+        return;
+    }
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+    if (l->fd >= FD_SETSIZE)
+    {
+        path_lost(p, k);
+        return;
+    }
+#endif
+    set_nonblock(l->fd, 1);
+    if (connect(l->fd, (struct sockaddr *)&p->dest[1], sizeof(p->dest[1])) == 0)
+    {
+        l->state = LEG_UP;
+        sess_path_up(p->sess, k);
+    }
+    else if (connect_in_progress())
+    {
+        l->state = LEG_CONNECTING;
+        l->when = clock_now_ms() + CONNECT_TIMEOUT_MS;
+    }
+    else
+        path_lost(p, k);
+}
+
+static void path_check(struct pair *p, int k, int writable)
+{
+    struct link *l = &p->sess->links[k];
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (writable)
+    {
+        if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, (char *) &err, &len) == 0 && !err)
+        {
+            l->state = LEG_UP;
+            sess_path_up(p->sess, k);
+        }
+        else
+            path_lost(p, k);
+    }
+    else if (clock_now_ms() >= l->when)
+        path_lost(p, k);
+}
+
+/* whether path l has bytes it can send now */
+static int path_due(const struct link *l)
+{
+    const struct seal *c = l->seal;
+
+    if (!c)
+        return l->ooff < l->olen;
+    return !c->salted || c->ooff < c->olen || (c->keyed && l->ooff < l->olen);
+}
+
+/* send what path k can, sealing it with -K; returns -1 if the pair is done */
+static int path_send(struct pair *p, int k)
+{
+    struct link *l = &p->sess->links[k];
+    struct seal *c = l->seal;
+    unsigned char *buf = l->obuf;
+    size_t *off = &l->ooff, *len = &l->olen, n;
+    int nbyt;
+
+    while (path_up(p, k) && path_due(l))
+    {
+        if (c && c->ooff == c->olen)
+        {
+            c->olen = c->ooff = 0;
+            if (!c->salted)
+            {
+                if (RAND_bytes(c->salt, SEAL_SALT) != 1)
+                {
+                    log_msg("pair %d: no random salt for session path %d", (int) (p - pairs), k);
+                    return path_lost(p, k);
+                }
+                memcpy(c->obuf, c->salt, SEAL_SALT);
+                c->olen = SEAL_SALT;
+                c->salted = 1;
+            }
+            else
+            {
+                n = l->olen - l->ooff < SEAL_RECORD_MAX ? l->olen - l->ooff : SEAL_RECORD_MAX;
+                if (seal_record(c, l->obuf + l->ooff, n))
+                {
+                    log_msg("pair %d: cannot seal on session path %d", (int) (p - pairs), k);
+                    return -1;
+                }
+                l->ooff += n;
+            }
+        }
+        if (c)
+        {
+            buf = c->obuf;
+            off = &c->ooff;
+            len = &c->olen;
+        }
+        nbyt = send(path_fd(p, k), buf + *off, *len - *off, 0);
+        if (nbyt < 0 && would_block())
+            break;
+        if (nbyt <= 0)
+            return path_lost(p, k);
+        *off += nbyt;
+        l->win_sent += nbyt;
+    }
+    if (l->ooff == l->olen)
+        l->olen = l->ooff = 0;
+    return 0;
+}
+
+/* room for a frame with len payload bytes on l, NULL if it does not fit right now */
+static unsigned char *link_frame(struct link *l, int type, size_t len)
+{
+    unsigned char *h;
+
+    if (l->ooff && l->olen + LINK_HDR + len > LINK_BUF)
+    {
+        memmove(l->obuf, l->obuf + l->ooff, l->olen - l->ooff);
+        l->olen -= l->ooff;
+        l->ooff = 0;
+    }
+    if (l->olen + LINK_HDR + len > LINK_BUF)
+        return NULL;
+    h = l->obuf + l->olen;
+    h[0] = (unsigned char) type;
+    h[1] = 0;
+    h[2] = (unsigned char) (len >> 8);
+    h[3] = (unsigned char) len;
+    l->olen += LINK_HDR + len;
+    return h + LINK_HDR;
+}
+
+/* the path for the next DATA frame: least queued relative to its rate */
+static struct link *sess_pick(struct pair *p)
+{
+    struct session *s = p->sess;
+    struct link *l, *best = NULL;
+    int k;
+
+    for (k = 0; k < s->npaths; ++k)
+    {
+        l = &s->links[k];
+        if (!path_up(p, k) || !l->hello || l->olen - l->ooff + LINK_HDR + LINK_FRAME_MAX > LINK_BUF)
+            continue;
+        if (!best || (unsigned long long) (l->olen - l->ooff) * (best->rate + 1)
+                     < (unsigned long long) (best->olen - best->ooff) * (l->rate + 1))
+            best = l;
+    }
+    return best;
+}
+
+/* queue what the session has to say, then send as much as the paths take */
+static int sess_output(struct pair *p)
+{
+    struct session *s = p->sess;
+    struct link *l;
+    unsigned char *f;
+    size_t pos, len;
+    int k;
+
+    for (k = 0; k < s->npaths; ++k)
+    {
+        l = &s->links[k];
+        if (!path_up(p, k))
+            continue;
+        if (l->hello_due && (f = link_frame(l, LINK_HELLO, 24)))
+        {
+            put64(f, s->id);
+            put64(f + 8, s->rcvd);
+            put32(f + 16, dedup_mb);
+            put32(f + 20, (unsigned int) zdict_sum);
+            l->hello_due = 0;
+        }
+        if (s->ack_due && l->hello && (f = link_frame(l, LINK_ACK, 8)))
+        {
+            put64(f, s->rcvd);
+            s->ack_due = 0;
+            s->acked = s->rcvd;
+            s->ack_at = clock_now_ms();
+        }
+    }
+    while (s->snd_nxt < s->snd_end && (l = sess_pick(p)))
+    {
+        pos = (size_t) (s->snd_nxt & (SESSION_WINDOW - 1));
+        len = s->snd_end - s->snd_nxt;
+        if (len > SESSION_WINDOW - pos)
+            len = SESSION_WINDOW - pos;
+        if (len > LINK_FRAME_MAX - 8)
+            len = LINK_FRAME_MAX - 8;
+        f = link_frame(l, LINK_DATA, 8 + len);
+        put64(f, s->snd_nxt);
+        memcpy(f + 8, s->ring + pos, len);
+        s->snd_nxt += len;
+        if (s->snd_nxt > s->snd_max)
+            s->snd_max = s->snd_nxt;
+    }
+    if (p->eof && !s->fin_sent && s->snd_nxt == s->snd_end && (l = sess_pick(p)))
+    {
+        put64(link_frame(l, LINK_FIN, 8), s->snd_end);
+        s->fin_sent = 1;
+    }
+
+    for (k = 0; k < s->npaths; ++k)
+        if (path_send(p, k))
+            return -1;
+    return 0;
+}
+
+/* the peer is known to have received everything before ack */
+static int sess_acked(struct pair *p, unsigned long long ack)
+{
+    struct session *s = p->sess;
+
+    if (ack > s->snd_max)
+    {
+        log_msg("pair %d: session peer is out of step", (int) (p - pairs));
+        return -1;
+    }
+    /* an older ack can arrive late on another path */
+    if (ack > s->snd_una)
+        s->snd_una = ack;
+    if (s->snd_nxt < s->snd_una)
+        s->snd_nxt = s->snd_una;
+    return 0;
+}
+
+/* file bytes at stream offset off into rring, -1 if the peer overran the window */
+static int sess_store(struct session *s, unsigned long long off, const unsigned char *data, size_t len)
+{
+    unsigned long long end = off + len;
+    size_t pos, n;
+    int i, j;
+
+    if (end <= s->rcvd)
+        return 0;
+    if (off < s->rcvd)
+    {
+        data += s->rcvd - off;
+        off = s->rcvd;
+    }
+    if (end > s->rcvd + SESSION_WINDOW)
+        return -1;
+    for (pos = (size_t) (off & (SESSION_WINDOW - 1)), n = (size_t) (end - off); n; )
+    {
+        len = n < SESSION_WINDOW - pos ? n : SESSION_WINDOW - pos;
+        memcpy(s->rring + pos, data, len);
+        data += len;
+        n -= len;
+        pos = 0;
+    }
+
+    /* merge [off, end) into the sorted stretches it touches */
+    for (i = 0; i < s->nranges && s->ranges[i].end < off; ++i)
+        ;
+    for (j = i; j < s->nranges && s->ranges[j].start <= end; ++j)
+    {
+        if (s->ranges[j].start < off)
+            off = s->ranges[j].start;
+        if (s->ranges[j].end > end)
+            end = s->ranges[j].end;
+    }
+    if (i == j)
+    {
+        if (s->nranges == SESSION_RANGES)
+            return -1;
+        memmove(&s->ranges[i + 1], &s->ranges[i], (s->nranges - i) * sizeof(s->ranges[0]));
+        ++s->nranges;
+    }
+    else
+    {
+        memmove(&s->ranges[i + 1], &s->ranges[j], (s->nranges - j) * sizeof(s->ranges[0]));
+        s->nranges -= j - i - 1;
+    }
+    s->ranges[i].start = off;
+    s->ranges[i].end = end;
+    return 0;
+}
+
+/* act on the frames received on path k, returns -1 if the pair is done */
+static int sess_input(struct pair *p, int k)
+{
+    struct session *s = p->sess;
+    struct link *l = &s->links[k];
+    unsigned char *f;
+    size_t off = 0, len;
+
+    while (l->ilen - off >= LINK_HDR)
+    {
+        f = l->ibuf + off;
+        len = (size_t) f[2] << 8 | f[3];
+        if (len > LINK_FRAME_MAX || (f[0] != LINK_HELLO && !l->hello))
+        {
+            log_msg("pair %d: bad frame on session path %d", (int) (p - pairs), k);
+            return path_lost(p, k);
+        }
+        if (l->ilen - off < LINK_HDR + len)
+            break;
+        f += LINK_HDR;
+        switch (f[-LINK_HDR])
+        {
+        case LINK_HELLO:
+            if (len < 16 || (s->peer && get64(f) != s->peer))
+            {
+                log_msg("pair %d: session peer restarted, its session is gone", (int) (p - pairs));
+                return -1;
+            }
+            if (get64(f) == s->id)
+            {
+                log_msg("pair %d: session path %d leads back to this end", (int) (p - pairs), k);
+                return -1;
+            }
+            if ((len < 20 ? 0 : get32(f + 16)) != dedup_mb
+                || (len < 24 ? 0 : get32(f + 20)) != (unsigned int) zdict_sum)
+            {
+                log_msg("pair %d: session peer uses another -D, -C or -Z", (int) (p - pairs));
+                return -1;
+            }
+            s->peer = get64(f);
+            if (sess_acked(p, get64(f + 8)))
+                return -1;
+            l->hello = 1;
+            s->down_since = 0;
+            break;
+        case LINK_DATA:
+            if (len < 8 || sess_store(s, get64(f), f + 8, len - 8))
+            {
+                log_msg("pair %d: session peer is out of step", (int) (p - pairs));
+                return -1;
+            }
+            break;
+        case LINK_ACK:
+            if (len < 8 || sess_acked(p, get64(f)))
+                return -1;
+            break;
+        case LINK_FIN:
+            if (len >= 8)
+                s->fin_at = get64(f);
+            break;
+        default:
+            break;                      /* from a newer peer, skip it */
+        }
+        off += LINK_HDR + len;
+    }
+    memmove(l->ibuf, l->ibuf + off, l->ilen - off);
+    l->ilen -= off;
+    return 0;
+}
+
+/* copy len bytes at stream offset off out of a session ring */
+static void ring_get(const char *ring, unsigned long long off, void *dst, size_t len)
+{
+    size_t pos = (size_t) (off & (SESSION_WINDOW - 1)), n;
+
+    n = len < SESSION_WINDOW - pos ? len : SESSION_WINDOW - pos;
+    memcpy(dst, ring + pos, n);
+    memcpy((char *) dst + n, ring, len - n);
+}
+
+/* append len bytes to the send ring, which has room for them */
+static void ring_put(struct session *s, const void *src, size_t len)
+{
+    size_t pos = (size_t) (s->snd_end & (SESSION_WINDOW - 1)), n;
+
+    n = len < SESSION_WINDOW - pos ? len : SESSION_WINDOW - pos;
+    memcpy(s->ring + pos, src, n);
+    memcpy(s->ring, (const char *) src + n, len - n);
+    s->snd_end += len;
+}
+
+/* how many of the peer's bytes from rcvd on have arrived */
+static size_t sess_avail(const struct session *s)
+{
+    return s->nranges && s->ranges[0].start <= s->rcvd ? (size_t) (s->ranges[0].end - s->rcvd) : 0;
+}
+
+/* the peer's bytes up to rcvd + n are done with */
+static void sess_consumed(struct session *s, size_t n)
+{
+    s->rcvd += n;
+    while (s->nranges && s->ranges[0].end <= s->rcvd)
+        memmove(&s->ranges[0], &s->ranges[1], --s->nranges * sizeof(s->ranges[0]));
+    if (s->rcvd - s->acked >= SESSION_WINDOW / 4)
+        s->ack_due = 1;
+}
+
+/*
+ * Send up to len bytes to leg one, returns how many went, 0 if none can
+ * go now, -1 if the pair is done.  After leg one ended, data is only
+ * counted.
+ */
+static int sess_give(struct pair *p, const char *data, size_t len)
+{
+    int nbyt;
+
+    if (p->eof)
+        return (int) len;
+    if (p->state[0] != LEG_UP)
+        return 0;
+    nbyt = send(p->wfd[0], data, len, 0);
+    if (nbyt < 0 && would_block())
+    {
+        p->sess->iblocked = 1;
+        return 0;
+    }
+    if (nbyt <= 0)
+        return pair_leg_down(p, 0) ? -1 : (int) len;
+    pair_account(p, 1, nbyt);
+    return nbyt;
+}
+
+/* decode the next record into cur; 0 if it has not all arrived yet */
+static int coder_next(struct pair *p)
+{
+    struct session *s = p->sess;
+    struct coder *d = s->cd;
+    unsigned char hdr[CODE_REF_LEN];
+    unsigned long long pos;
+    size_t avail, len, clen;
+
+    if ((avail = sess_avail(s)) < CODE_HDR)
+        return 0;
+    ring_get(s->rring, s->rcvd, hdr, avail < CODE_REF_LEN ? avail : CODE_REF_LEN);
+    len = (size_t) hdr[1] << 8 | hdr[2];
+    if (!len || len > CODE_PIECE)
+        ;
+    else if (hdr[0] == CODE_LIT)
+    {
+        if (avail < CODE_HDR + len)
+            return 0;
+        d->cur = d->size ? d->cache + dedup_place(d, &d->rx_written, len) % d->size : d->piece;
+        ring_get(s->rring, s->rcvd + CODE_HDR, d->cur, len);
+        d->cur_rec = CODE_HDR + len;
+    }
+    else if (hdr[0] == CODE_ZLIT && d->zready)
+    {
+        if (avail < CODE_ZLIT_HDR)
+            return 0;
+        if ((clen = (size_t) hdr[3] << 8 | hdr[4]) <= sizeof(d->zrec))
+        {
+            if (avail < CODE_ZLIT_HDR + clen)
+                return 0;
+            ring_get(s->rring, s->rcvd + CODE_ZLIT_HDR, d->zrec, clen);
+        }
+        if (clen > sizeof(d->zrec) || coder_inflate(d, clen, len))
+        {
+            log_msg("pair %d: corrupt compressed record", (int) (p - pairs));
+            return -1;
+        }
+        d->cur = d->piece;
+        if (d->size)
+        {
+            d->cur = d->cache + dedup_place(d, &d->rx_written, len) % d->size;
+            memcpy(d->cur, d->piece, len);
+        }
+        d->cur_rec = CODE_ZLIT_HDR + clen;
+    }
+    else if (hdr[0] == CODE_REF && d->size)
+    {
+        if (avail < CODE_REF_LEN)
+            return 0;
+        pos = get64(hdr + CODE_HDR);
+        if (!dedup_cached(d, d->rx_written, pos, len) || pos % d->size + len > d->size)
+        {
+            log_msg("pair %d: dedup reference to a chunk no longer cached", (int) (p - pairs));
+            return -1;
+        }
+        d->cur = d->cache + pos % d->size;
+        d->cur_rec = CODE_REF_LEN;
+    }
+    if (!d->cur_rec)
+    {
+        log_msg("pair %d: bad coded record", (int) (p - pairs));
+        return -1;
+    }
+    d->cur_len = len;
+    d->cur_done = 0;
+    return 1;
+}
+
+/* decode coded records in order and pass their bytes to leg one */
+static int coder_deliver(struct pair *p)
+{
+    struct session *s = p->sess;
+    struct coder *d = s->cd;
+    int nbyt;
+
+    for (;;)
+    {
+        if (!d->cur_rec && (nbyt = coder_next(p)) <= 0)
+            return nbyt;
+        nbyt = sess_give(p, (char *) d->cur + d->cur_done, d->cur_len - d->cur_done);
+        if (nbyt <= 0)
+            return nbyt;
+        if ((d->cur_done += nbyt) == d->cur_len)
+        {
+            sess_consumed(s, d->cur_rec);
+            d->cur_rec = 0;
+        }
+    }
+}
+
+/* pass what has arrived in order on to leg one */
+static int sess_deliver(struct pair *p)
+{
+    struct session *s = p->sess;
+    size_t pos, len;
+    int nbyt;
+
+    if (s->cd)
+    {
+        if (coder_deliver(p))
+            return -1;
+    }
+    else
+    {
+        while ((len = sess_avail(s)))
+        {
+            pos = (size_t) (s->rcvd & (SESSION_WINDOW - 1));
+            if (len > SESSION_WINDOW - pos)
+                len = SESSION_WINDOW - pos;
+            if ((nbyt = sess_give(p, s->rring + pos, len)) <= 0)
+            {
+                if (nbyt)
+                    return -1;
+                break;
+            }
+            sess_consumed(s, nbyt);
+        }
+    }
+    if (!s->fin_seen && s->rcvd >= s->fin_at)
+    {
+        s->fin_seen = 1;
+        s->ack_due = 1;
+    }
+    return 0;
+}
+
+/* how many input bytes surely code into what is left of the send ring */
+static size_t coder_room(const struct session *s)
+{
+    size_t room = SESSION_WINDOW - (size_t) (s->snd_end - s->snd_una);
+
+    return room > CODE_SLACK ? (room - CODE_SLACK) * DEDUP_MIN / (DEDUP_MIN + CODE_SLACK) : 0;
+}
+
+/* scratch for coding one relay buffer */
+static unsigned char coder_out[RELAY_BUF_MAX + (RELAY_BUF_MAX / DEDUP_MIN + 1) * CODE_SLACK];
+
+/* whether uncoded data waits, and fits the send ring once coded */
+static int coder_due(const struct pair *p)
+{
+    return p->sess->cd && p->len[0] && coder_room(p->sess) >= p->len[0];
+}
+
+/*
+ * Code what leg one delivered into the send ring.  With -D, buf[0] holds
+ * len[0] bytes not coded yet because no chunk boundary followed them; they wait
+ * up to DEDUP_HOLD_MS for more, so that chunks stay content-defined
+ * across reads, and are coded as they are once leg one stays quiet.
+ */
+static void coder_push(struct pair *p, int flush)
+{
+    struct session *s = p->sess;
+    size_t used;
+
+    if (!p->len[0])
+        return;
+    ring_put(s, coder_out, coder_encode(s->cd, (unsigned char *) p->buf[0], p->len[0], coder_out,
+                                        &used, flush));
+    memmove(p->buf[0], p->buf[0] + used, p->len[0] - used);
+    p->len[0] -= used;
+    s->cd->held = clock_now_ms();
+}
+
+/* move one chunk from leg one into the ring, coded with -D or -C */
+static int sess_read(struct pair *p)
+{
+    struct session *s = p->sess;
+    size_t pos, len;
+    int nbyt;
+
+    len = SESSION_WINDOW - (size_t) (s->snd_end - s->snd_una);
+    if (s->cd)
+    {
+        len = coder_room(s) - p->len[0];
+        if (!p->len[0] && pair_buf(p, 0))
+            return -1;
+        if (len > p->bufsize[0] - p->len[0])
+            len = p->bufsize[0] - p->len[0];
+        nbyt = recv(p->fd[0], p->buf[0] + p->len[0], len, 0);
+        if (nbyt < 0 && would_block())
+            return 0;
+        if (nbyt <= 0)
+        {
+            coder_push(p, 1);
+            return pair_leg_down(p, 0);
+        }
+        pair_account(p, 0, nbyt);
+        p->len[0] += nbyt;
+        coder_push(p, 0);
+        return 0;
+    }
+    pos = (size_t) (s->snd_end & (SESSION_WINDOW - 1));
+    if (len > SESSION_WINDOW - pos)
+        len = SESSION_WINDOW - pos;
+    nbyt = recv(p->fd[0], s->ring + pos, len, 0);
+    if (nbyt < 0 && would_block())
+        return 0;
+    if (nbyt <= 0)
+        return pair_leg_down(p, 0);
+    s->snd_end += nbyt;
+    pair_account(p, 0, nbyt);
+    return 0;
+}
+
+/* move one chunk from sealed path k into its ibuf as it opens, and act on it */
+static int seal_read_path(struct pair *p, int k)
+{
+    struct link *l = &p->sess->links[k];
+    struct seal *c = l->seal;
+    int nbyt;
+
+    nbyt = recv(path_fd(p, k), c->ibuf + c->ilen, SEAL_BUF - c->ilen, 0);
+    if (nbyt < 0 && would_block())
+        return 0;
+    if (nbyt <= 0)
+        return path_lost(p, k);
+    c->ilen += nbyt;
+    if (!c->keyed)
+    {
+        if (c->ilen < SEAL_SALT)
+            return 0;
+        memcpy(c->peer_salt, c->ibuf, SEAL_SALT);
+        c->ilen -= SEAL_SALT;
+        memmove(c->ibuf, c->ibuf + SEAL_SALT, c->ilen);
+        if (!memcmp(c->peer_salt, c->salt, SEAL_SALT))
+        {
+            log_msg("pair %d: session path %d echoes our salt back", (int) (p - pairs), k);
+            return path_lost(p, k);
+        }
+        if (seal_keys(c))
+        {
+            log_msg("pair %d: cannot derive keys for session path %d", (int) (p - pairs), k);
+            return -1;
+        }
+    }
+    while ((nbyt = seal_open(c, l->ibuf + l->ilen)) > 0)
+    {
+        l->ilen += nbyt;
+        if (sess_input(p, k))
+            return -1;
+        if (!path_up(p, k))
+            return 0;
+    }
+    if (nbyt < 0)
+    {
+        log_msg("pair %d: session path %d does not authenticate, wrong -K?", (int) (p - pairs), k);
+        return path_lost(p, k);
+    }
+    return 0;
+}
+
+/* move one chunk from path k into its ibuf and act on it */
+static int sess_read_path(struct pair *p, int k)
+{
+    struct link *l = &p->sess->links[k];
+    int nbyt;
+
+    if (l->seal)
+        return seal_read_path(p, k);
+    nbyt = recv(path_fd(p, k), l->ibuf + l->ilen, LINK_BUF - l->ilen, 0);
+    if (nbyt < 0 && would_block())
+        return 0;
+    if (nbyt <= 0)
+        return path_lost(p, k);
+    l->ilen += nbyt;
+    return sess_input(p, k);
+}
+
+static int sess_leg_readable(struct pair *p)
+{
+    struct session *s = p->sess;
+
+    if (p->state[0] != LEG_UP || p->paused || p->eof)
+        return 0;
+    if (s->cd)
+        return coder_room(s) > p->len[0];
+    return s->snd_end - s->snd_una < SESSION_WINDOW;
+}
+
+static void sess_fdset(struct pair *p, fd_set *fdsr, fd_set *fdsw, SOCKET *maxsock)
+{
+    struct session *s = p->sess;
+    struct link *l;
+    int k;
+
+    if (sess_leg_readable(p))
+        FD_SET(p->fd[0], fdsr);
+    if (s->iblocked && p->state[0] == LEG_UP)
+        FD_SET(p->wfd[0], fdsw);
+    for (k = 0; k < s->npaths; ++k)
+    {
+        l = &s->links[k];
+        if (k && l->state == LEG_CONNECTING)
+            FD_SET(l->fd, fdsw);
+        if (!path_up(p, k))
+            continue;
+        FD_SET(path_fd(p, k), fdsr);
+        if (path_due(l))
+            FD_SET(path_fd(p, k), fdsw);
+    }
+    for (k = 1; k < s->npaths; ++k)
+        if (s->links[k].fd != INVALID_SOCKET && s->links[k].fd > *maxsock)
+            *maxsock = s->links[k].fd;
+}
+
+/* returns -1 once the pair is done */
+static int sess_service(struct pair *p, fd_set *fdsr, fd_set *fdsw)
+{
+    struct session *s = p->sess;
+    int k;
+
+    for (k = 1; k < s->npaths; ++k)
+        if (s->links[k].state == LEG_CONNECTING)
+            path_check(p, k, FD_ISSET(s->links[k].fd, fdsw));
+    if (sess_leg_readable(p) && FD_ISSET(p->fd[0], fdsr) && sess_read(p))
+        return -1;
+    for (k = 0; k < s->npaths; ++k)
+        if (path_up(p, k) && FD_ISSET(path_fd(p, k), fdsr) && sess_read_path(p, k))
+            return -1;
+    if (s->iblocked && p->state[0] == LEG_UP && FD_ISSET(p->wfd[0], fdsw))
+        s->iblocked = 0;
+    if (!s->iblocked && sess_deliver(p))
+        return -1;
+    if (sess_output(p))
+        return -1;
+    /* a path that is down has nothing in flight, whatever its buffers say */
+    for (k = 0; k < s->npaths; ++k)
+        if (path_up(p, k) && path_due(&s->links[k]))
+            return 0;
+    if ((s->fin_seen && !s->ack_due) || (s->fin_sent && s->snd_una == s->snd_end))
+        return -1;
+    return 0;
+}
+
+/* forward one chunk arriving on leg `from', returns -1 if the pair is done */
+static int pair_forward(struct pair *p, int from)
+{
+    int nbyt;
+
+#ifdef SPLICE_F_MOVE
+    if (p->splice[from])
+    {
+        /* EAGAIN here almost always means the destination is full */
+        nbyt = splice(p->fd[from], NULL, p->wfd[!from], NULL, SPLICE_CHUNK,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (nbyt < 0 && would_block())
+        {
+            p->blocked[from] = 1;
+            return 0;
+        }
+        if (nbyt <= 0)
+            return pair_leg_down(p, nbyt < 0 && errno == EPIPE ? !from : from);
+        pair_account(p, from, nbyt);
+        return 0;
+    }
+#endif
+
+    if (pair_buf(p, from))
+        return -1;
+    nbyt = leg_recv(p, from, p->buf[from], p->bufsize[from]);
+    if (nbyt < 0 && would_block())
+        return 0;
+    if (nbyt <= 0)
+        return pair_leg_down(p, from);
+    p->len[from] = nbyt;
+    p->off[from] = 0;
+    pair_account(p, from, nbyt);
+    if (from == 0 && p->spool.name[0])
+        return pair_spool(p);
+    if (from == 1 && p->eof)
+    {
+        p->len[1] = 0;
+        return 0;
+    }
+    return pair_flush(p, from);
+}
+
+/*
+ * Whether leg i is read: both legs have to be up, except that a spooling
+ * pair reads leg one whenever it is up and has not ended.
+ */
+static int pair_readable(struct pair *p, int i)
+{
+    if (p->state[i] != LEG_UP || p->paused || (i == 0 && p->eof))
+        return 0;
+    return p->state[!i] == LEG_UP || (i == 0 && p->spool.name[0]);
+}
+
+/* take a batch of datagrams from leg one and pass them on, framed */
+static int udp_read(struct pair *p)
+{
+#ifdef MSG_WAITFORONE
+    struct mmsghdr msg[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+#endif
+    unsigned char *b;
+    size_t n, i, o = 0, len;
+    int got;
+
+    if (pair_buf(p, 0))
+        return -1;
+    if ((n = p->bufsize[0] / UDP_SLOT) > UDP_BATCH)
+        n = UDP_BATCH;
+#ifdef MSG_WAITFORONE
+    memset(msg, 0, n * sizeof(*msg));
+    for (i = 0; i < n; ++i)
+    {
+        iov[i].iov_base = p->buf[0] + i * UDP_SLOT + 2;
+        iov[i].iov_len = UDP_DGRAM_MAX;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+    if ((got = recvmmsg(p->fd[0], msg, (unsigned int) n, MSG_WAITFORONE, NULL)) < 0)
+    {
+        if (would_block() || peer_refused())
+            return 0;
+        return pair_leg_down(p, 0);
+    }
+    for (i = 0; i < (size_t) got; ++i)
+    {
+        if (msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            ++p->dropped;
+            continue;
+        }
+        len = msg[i].msg_len;
+        b = (unsigned char *) p->buf[0] + o;
+        memmove(b + 2, p->buf[0] + i * UDP_SLOT + 2, len);
+#else
+    for (i = 0; i < n; ++i)
+    {
+        /* one byte more than fits tells a datagram that was cut short */
+        b = (unsigned char *) p->buf[0] + o;
+        if ((got = recv(p->fd[0], (char *) b + 2, UDP_DGRAM_MAX + 1, 0)) < 0)
+        {
+            if (would_block() || peer_refused())
+                break;
+            return pair_leg_down(p, 0);
+        }
+        if ((len = (size_t) got) > UDP_DGRAM_MAX)
+        {
+            ++p->dropped;
+            continue;
+        }
+#endif
+        b[0] = (unsigned char) (len >> 8);
+        b[1] = (unsigned char) len;
+        o += 2 + len;
+        pair_account(p, 0, (int) len);
+    }
+    p->len[0] = o;
+    p->off[0] = 0;
+    if (p->spool.name[0])
+        return pair_spool(p);
+    return pair_flush(p, 0);
+}
+
+/* send the whole datagrams in buf[1] to leg one, keeping a partial one for later */
+static int udp_flush(struct pair *p)
+{
+#ifdef MSG_WAITFORONE
+    struct mmsghdr msg[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+#endif
+    size_t at[UDP_BATCH], sz[UDP_BATCH], pos;
+    unsigned char *b;
+    int n, i, sent;
+
+    for (;;)
+    {
+        for (n = 0, pos = p->off[1]; n < UDP_BATCH && p->len[1] - pos >= 2; ++n, pos += 2 + sz[n - 1])
+        {
+            b = (unsigned char *) p->buf[1] + pos;
+            if ((sz[n] = (size_t) b[0] << 8 | b[1]) > UDP_DGRAM_MAX)
+            {
+                log_msg("pair %d: bad datagram length from leg two", (int) (p - pairs));
+                return -1;
+            }
+            if (p->len[1] - pos - 2 < sz[n])
+                break;
+            at[n] = pos + 2;
+        }
+        if (!n)
+            break;
+#ifdef MSG_WAITFORONE
+        memset(msg, 0, n * sizeof(*msg));
+        for (i = 0; i < n; ++i)
+        {
+            iov[i].iov_base = p->buf[1] + at[i];
+            iov[i].iov_len = sz[i];
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        sent = sendmmsg(p->wfd[0], msg, (unsigned int) n, 0);
+#else
+        sent = send(p->wfd[0], p->buf[1] + at[0], sz[0], 0) < 0 ? -1 : 1;
+#endif
+        if (sent < 0 && would_block())
+        {
+            p->blocked[1] = 1;
+            return 0;
+        }
+        if (sent < 0 && !peer_refused())
+            return pair_leg_down(p, 0);
+        /* a refusal belongs to an earlier datagram, this one is simply sent again */
+        for (i = 0; i < sent; ++i)
+            p->off[1] = at[i] + sz[i];
+    }
+    memmove(p->buf[1], p->buf[1] + p->off[1], p->len[1] - p->off[1]);
+    p->len[1] -= p->off[1];
+    p->off[1] = 0;
+    return 0;
+}
+
+/* read what leg two sent into buf[1], behind any partial datagram, and send it on */
+static int udp_forward(struct pair *p)
+{
+    int nbyt;
+
+    if (!p->len[1] && pair_buf(p, 1))
+        return -1;
+    nbyt = leg_recv(p, 1, p->buf[1] + p->len[1], p->bufsize[1] - p->len[1]);
+    if (nbyt < 0 && would_block())
+        return 0;
+    if (nbyt <= 0)
+        return pair_leg_down(p, 1);
+    pair_account(p, 1, nbyt);
+    p->len[1] += nbyt;
+    if (p->eof)
+    {
+        p->len[1] = 0;
+        return 0;
+    }
+    return udp_flush(p);
+}
+
+static void udp_fdset(struct pair *p, fd_set *fdsr, fd_set *fdsw)
+{
+    if (p->off[0] < p->len[0])
+    {
+        if (p->state[1] == LEG_UP)
+            FD_SET(p->wfd[1], fdsw);
+    }
+    else if (pair_readable(p, 0))
+        FD_SET(p->fd[0], fdsr);
+    if (p->blocked[1])
+    {
+        if (p->state[0] == LEG_UP)
+            FD_SET(p->wfd[0], fdsw);
+    }
+    else if (pair_readable(p, 1))
+    {
+        FD_SET(p->fd[1], fdsr);
+        tls_ready |= leg_pending(p, 1);
+    }
+}
+
+/* returns -1 if the pair is done */
+static int udp_service(struct pair *p, fd_set *fdsr, fd_set *fdsw)
+{
+    if (p->off[0] < p->len[0])
+    {
+        if (p->state[1] == LEG_UP && FD_ISSET(p->wfd[1], fdsw) && pair_flush(p, 0))
+            return -1;
+    }
+    else if (pair_readable(p, 0) && FD_ISSET(p->fd[0], fdsr) && udp_read(p))
+        return -1;
+    if (p->blocked[1])
+    {
+        if (p->state[0] == LEG_UP && FD_ISSET(p->wfd[0], fdsw))
+        {
+            p->blocked[1] = 0;
+            if (udp_flush(p))
+                return -1;
+        }
+    }
+    else if (pair_readable(p, 1) && (FD_ISSET(p->fd[1], fdsr) || leg_pending(p, 1)) && udp_forward(p))
+        return -1;
+    return 0;
+}
+
+/*
+ * Add the pair's sockets to the select() sets.  A direction with data
+ * still buffered (or a spliced one whose destination was full) waits for
+ * its destination to become writable and does not read more until then,
+ * so a slow leg only ever holds up its own pair.
+ */
+static void pair_fdset(struct pair *p, fd_set *fdsr, fd_set *fdsw, SOCKET *maxsock)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (p->state[i] == LEG_CONNECTING)
+            FD_SET(p->fd[i], p->handshake[i] && p->hs_read[i] ? fdsr : fdsw);
+        else if (p->state[i] == LEG_HELLO)
+            FD_SET(p->fd[i], fdsr);
+        if (p->sess || p->udp)
+            continue;
+        if (p->off[i] < p->len[i] || p->blocked[i])
+        {
+            if (p->state[!i] == LEG_UP)
+                FD_SET(p->wfd[!i], fdsw);
+        }
+        else if (pair_readable(p, i))
+        {
+            FD_SET(p->fd[i], fdsr);
+            tls_ready |= leg_pending(p, i);
+        }
+    }
+    if (p->spool.bytes && p->state[1] == LEG_UP)
+        FD_SET(p->wfd[1], fdsw);
+    if (p->sess)
+        sess_fdset(p, fdsr, fdsw, maxsock);
+    if (p->udp)
+        udp_fdset(p, fdsr, fdsw);
+    for (i = 0; i < 2; ++i)
+    {
+        if (p->fd[i] != INVALID_SOCKET && p->fd[i] > *maxsock)
+            *maxsock = p->fd[i];
+        if (p->wfd[i] != INVALID_SOCKET && p->wfd[i] > *maxsock)
+            *maxsock = p->wfd[i];
+    }
+}
+
+static void pair_service(struct pair *p, fd_set *fdsr, fd_set *fdsw)
+{
+    int i;
+
+    for (i = 0; i < 2 && p->used; ++i)
+    {
+        if (p->state[i] == LEG_HELLO && FD_ISSET(p->fd[i], fdsr))
+        {
+            /* the client has turned up, its handshake is timed from here */
+            leg_set_state(p, i, LEG_CONNECTING);
+            p->when[i] = clock_now_ms() + CONNECT_TIMEOUT_MS;
+        }
+        if (p->state[i] == LEG_CONNECTING)
+            leg_check(p, i, FD_ISSET(p->fd[i], p->handshake[i] && p->hs_read[i] ? fdsr : fdsw));
+    }
+    if (!p->used)
+        return;
+    if (p->sess)
+    {
+        if (sess_service(p, fdsr, fdsw))
+            pair_close(p);
+        return;
+    }
+    if (p->udp)
+        i = udp_service(p, fdsr, fdsw) ? 0 : 2;
+    else
+        for (i = 0; i < 2; ++i)
+        {
+            if (p->off[i] < p->len[i] || p->blocked[i])
+            {
+                if (p->state[!i] != LEG_UP || !FD_ISSET(p->wfd[!i], fdsw))
+                    continue;
+                p->blocked[i] = 0;
+                if (pair_flush(p, i))
+                    break;
+            }
+            else if (pair_readable(p, i) && (FD_ISSET(p->fd[i], fdsr) || leg_pending(p, i))
+                     && pair_forward(p, i))
+                break;
+        }
+    if (i == 2 && p->spool.bytes && p->state[1] == LEG_UP && FD_ISSET(p->wfd[1], fdsw)
+        && spool_drain(p))
+        i = 0;
+    if (i < 2 || (p->eof && !p->spool.bytes))
+        pair_close(p);
+}
+
+/*
+ * Connect further paths and time out their connects, send acknowledgements
+ * and held dedup data that are due, measure path rates and give up on
+ * links down for too long.
+ */
+static void sess_run(void)
+{
+    struct session *s;
+    struct link *l;
+    unsigned long long elapsed;
+    int id, k;
+
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        if (!pairs[id].used || !(s = pairs[id].sess))
+            continue;
+        if (s->down_since && clock_now_ms() - s->down_since >= SESSION_TIMEOUT_MS)
+        {
+            log_msg("pair %d: session link down for too long", id);
+            pair_close(&pairs[id]);
+            continue;
+        }
+        for (k = 1; k < s->npaths; ++k)
+        {
+            l = &s->links[k];
+            if (l->state == LEG_QUEUED && l->when <= clock_now_ms())
+                path_connect(&pairs[id], k);
+            else if (l->state == LEG_CONNECTING)
+                path_check(&pairs[id], k, 0);
+        }
+        if ((elapsed = clock_now_ms() - s->win_start) >= RATE_WINDOW_MS)
+        {
+            for (k = 0; k < s->npaths; ++k)
+            {
+                s->links[k].rate = (s->links[k].rate + s->links[k].win_sent * 1000 / elapsed) / 2;
+                s->links[k].win_sent = 0;
+            }
+            if (s->cd)
+                coder_tune(s->cd, s->snd_end - s->snd_una >= SESSION_WINDOW / 2);
+            s->win_start = clock_now_ms();
+        }
+        if (coder_due(&pairs[id]) && clock_now_ms() - s->cd->held >= DEDUP_HOLD_MS)
+            coder_push(&pairs[id], 1);
+        if (s->rcvd != s->acked && clock_now_ms() - s->ack_at >= SESSION_ACK_MS)
+            s->ack_due = 1;
+        if (sess_output(&pairs[id]))
+            pair_close(&pairs[id]);
+    }
+}
+
+/* ms until sess_run() has something to do, -1 if never */
+static long sess_next_wakeup(void)
+{
+    unsigned long long next = ~0ULL, now = clock_now_ms();
+    struct session *s;
+    int id, k;
+
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        if (!pairs[id].used || !(s = pairs[id].sess))
+            continue;
+        if (s->down_since && s->down_since + SESSION_TIMEOUT_MS < next)
+            next = s->down_since + SESSION_TIMEOUT_MS;
+        if (s->rcvd != s->acked && !s->ack_due && s->ack_at + SESSION_ACK_MS < next)
+            next = s->ack_at + SESSION_ACK_MS;
+        if (coder_due(&pairs[id]) && s->cd->held + DEDUP_HOLD_MS < next)
+            next = s->cd->held + DEDUP_HOLD_MS;
+        for (k = 1; k < s->npaths; ++k)
+            if (s->links[k].state != LEG_UP && s->links[k].when < next)
+                next = s->links[k].when;
+    }
+    if (next == ~0ULL)
+        return -1;
+    return next > now ? (long) (next - now) : 0;
+}
+
+/*
+ * Buffer autotuning.
+ *
+ * Once per TUNE_INTERVAL_MS every leg's bandwidth-delay product is
+ * estimated from its TCP_INFO round-trip time and the rates measured for
+ * "stats" (plus the congestion window on the sending side), and its
+ * SO_SNDBUF/SO_RCVBUF are set to twice that.  A leg whose throughput is
+ * limited by its buffer therefore doubles it every interval until the
+ * path is the limit, while idle legs shrink to SOCKBUF_MIN and give their
+ * kernel memory back.  The user-space relay buffer of each direction
+ * follows the incoming BDP the same way, so fast legs move more per
+ * syscall.  Setting the socket buffers turns off the kernel's own
+ * autotuning for that socket; -t leaves it alone instead.
+ */
+#define TUNE_INTERVAL_MS    RATE_WINDOW_MS
+#define SOCKBUF_MIN         (64 * 1024)
+#define SOCKBUF_MAX         (8 * 1024 * 1024)
+
+static int autotune = 1;
+static unsigned long long tune_next;
+
+static size_t clamp_size(unsigned long long v, size_t lo, size_t hi)
+{
+    return v < lo ? lo : v > hi ? hi : (size_t) v;
+}
+
+#if defined(__linux__) && defined(TCP_INFO)
+/* set a socket buffer unless it is within 25% of the wanted size already */
+static void sockbuf_set(SOCKET fd, int opt, int want)
+{
+    int cur;
+    socklen_t len = sizeof(cur);
+
+    /* Linux reports twice the size that was set, to cover its overhead */
+    if (getsockopt(fd, SOL_SOCKET, opt, &cur, &len) == 0)
+    {
+        cur /= 2;
+        if (cur > want - want / 4 && cur < want + want / 4)
+            return;
+    }
+    setsockopt(fd, SOL_SOCKET, opt, &want, sizeof(want));
+}
+
+static void leg_tune(struct pair *p, int i)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    unsigned long long rtt, bdp_out, bdp_in;
+
+    if (getsockopt(p->fd[i], IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return;
+    rtt = ti.tcpi_rtt > ti.tcpi_rcv_rtt ? ti.tcpi_rtt : ti.tcpi_rcv_rtt;
+    bdp_out = p->rate[!i] * rtt / 1000000;
+    if ((unsigned long long) ti.tcpi_snd_cwnd * ti.tcpi_snd_mss > bdp_out)
+        bdp_out = (unsigned long long) ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+    bdp_in = p->rate[i] * rtt / 1000000;
+
+    sockbuf_set(p->fd[i], SO_SNDBUF, (int) clamp_size(2 * bdp_out, SOCKBUF_MIN, SOCKBUF_MAX));
+    sockbuf_set(p->fd[i], SO_RCVBUF, (int) clamp_size(2 * bdp_in, SOCKBUF_MIN, SOCKBUF_MAX));
+    if (!realtime)
+        p->bufwant[i] = clamp_size(bdp_in, p->udp && i ? UDP_BUF_MIN : RELAY_BUF_MIN, RELAY_BUF_MAX);
+}
+#endif
+
+static void tune_run(void)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    int id, i;
+
+    if (!autotune || clock_now_ms() < tune_next)
+        return;
+    tune_next = clock_now_ms() + TUNE_INTERVAL_MS;
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        if (!pairs[id].used || pairs[id].state[0] != LEG_UP || pairs[id].state[1] != LEG_UP)
+            continue;
+        if (clock_now_ms() - pairs[id].win_start >= RATE_WINDOW_MS)
+            rate_roll(&pairs[id]);
+        for (i = 0; i < 2; ++i)
+            if (!pairs[id].stdio[i])
+                leg_tune(&pairs[id], i);
+    }
+#endif
+}
+
+/* ms until the next tuning pass, -1 if none is needed */
+static long tune_next_wakeup(void)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    if (autotune && npairs)
+        return tune_next > clock_now_ms() ? (long) (tune_next - clock_now_ms()) : 0;
+#endif
+    return -1;
+}
+
+static void stats_dump(void)
+{
+    int id;
+
+    for (id = 0; id < MAX_PAIRS; ++id)
+    {
+        if (!pairs[id].used)
+            continue;
+        if (clock_now_ms() - pairs[id].win_start >= RATE_WINDOW_MS)
+            rate_roll(&pairs[id]);
+        log_dump("stats: pair %d leg1->leg2 %llu bytes %llu B/s, leg2->leg1 %llu bytes %llu B/s, "
+                "%llu spooled%s", id, pairs[id].bytes[0], pairs[id].rate[0], pairs[id].bytes[1],
+                pairs[id].rate[1], pairs[id].spool.bytes, pairs[id].paused ? " (paused)" : "");
+        if (pairs[id].udp && pairs[id].dropped)
+            log_dump("stats: pair %d dropped %llu datagrams too long to carry", id, pairs[id].dropped);
+        if (pairs[id].sess && pairs[id].sess->cd)
+            log_dump("stats: pair %d coding %llu bytes to %llu, level %d, %llu bypassed", id,
+                    pairs[id].sess->cd->raw, pairs[id].sess->cd->coded, pairs[id].sess->cd->zlevel,
+                    pairs[id].sess->cd->bypassed);
+    }
+    log_dump("stats: %d pairs holding %llu bytes of relay buffers", npairs, relay_held);
+    if (realtime)
+        log_dump("stats: realtime violations: %llu page faults, %llu allocations", rt_faults, rt_allocs);
+}
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+/*
+ * Control command queue.
+ *
+ * Control actions are posted to the relay loop through a bounded lock-free
+ * multi-producer/single-consumer queue (Vyukov's sequence-numbered ring) and
+ * the loop is woken through an eventfd (a pipe elsewhere) that sits in its
+ * select() set.  Producers never take a lock and never wait for the relay
+ * thread, which drains the whole queue in one go when the wakeup fd becomes
+ * readable.  Enqueueing only touches atomics and write(), so it is safe to
+ * do from a signal handler as well.
+ */
+#define CMDQ_SLOTS 1024
+
+enum cmd_op
+{
+    CMD_DUMP_STATS
+};
+
+struct cmd
+{
+    int op;
+    long arg;
+};
+
+static struct cmdq_slot
+{
+    atomic_uint seq;
+    struct cmd cmd;
+} cmdq_slots[CMDQ_SLOTS];
+static atomic_uint cmdq_enq;
+static unsigned int cmdq_deq;
+static int cmdq_fd[2] = { -1, -1 };
+
+static int cmdq_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < CMDQ_SLOTS; ++i)
+        atomic_init(&cmdq_slots[i].seq, i);
+#ifdef __linux__
+    if ((cmdq_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)
+    {
+        cmdq_fd[1] = cmdq_fd[0];
+        return 0;
+    }
+#endif
+    if (pipe(cmdq_fd))
+        return -1;
+    fcntl(cmdq_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(cmdq_fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/* returns -1 if the queue is full */
+static int cmdq_post(const struct cmd *c)
+{
+    unsigned long long one = 1;
+    struct cmdq_slot *slot;
+    unsigned int pos = atomic_load_explicit(&cmdq_enq, memory_order_relaxed);
+    int diff, saved = errno;
+
+    for (;;)
+    {
+        slot = &cmdq_slots[pos % CMDQ_SLOTS];
+        diff = (int) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&cmdq_enq, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&cmdq_enq, memory_order_relaxed);
+    }
+    slot->cmd = *c;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    /* a full eventfd/pipe already means a wakeup is pending */
+    if (write(cmdq_fd[1], &one, cmdq_fd[0] == cmdq_fd[1] ? sizeof(one) : 1) < 0)
+    {
+    }
+    errno = saved;
+    return 0;
+}
+
+/* returns -1 if the queue is empty */
+static int cmdq_take(struct cmd *c)
+{
+    struct cmdq_slot *slot = &cmdq_slots[cmdq_deq % CMDQ_SLOTS];
+
+    if ((int) (atomic_load_explicit(&slot->seq, memory_order_acquire) - (cmdq_deq + 1)) < 0)
+        return -1;
+    *c = slot->cmd;
+    atomic_store_explicit(&slot->seq, cmdq_deq + CMDQ_SLOTS, memory_order_release);
+    ++cmdq_deq;
+    return 0;
+}
+
+static void cmdq_drain(void)
+{
+    unsigned char junk[64];
+    struct cmd c;
+
+    while (read(cmdq_fd[0], junk, sizeof(junk)) > 0)
+        ;
+    while (cmdq_take(&c) == 0)
+    {
+        switch (c.op)
+        {
+        case CMD_DUMP_STATS:
+            stats_dump();
+            break;
+        }
+    }
+}
+
+static void on_sigusr1(int sig)
+{
+    struct cmd c = { CMD_DUMP_STATS, 0 };
+
+    (void) sig;
+    cmdq_post(&c);
+}
+
+/*
+ * Control socket.
+ *
+ * A line-oriented text protocol on a Unix socket lets pairs be created,
+ * destroyed, paused and inspected without restarting the process:
+ *
+ *   add HOST1 PORT1 HOST2 PORT2 [KEY] -> ok ID
+ *   del ID | pause ID | resume ID     -> ok
+ *   rate ID LEG BYTESPERSEC           -> ok
+ *   record ID LEG BYTES               -> ok
+ *   stats ID                          -> ok ID BYTES1TO2 BYTES2TO1 PAUSED
+ *                                            RATE1TO2 RATE2TO1 PACE1 PACE2 SPOOLED
+ *   list                              -> ok ID ...
+ *
+ * KEY is the session key used to pick from a backend list in HOST2.  LEG
+ * is 1 or 2 and "rate" paces what is sent on that leg, 0 lifts the cap.
+ * "record" sets how much a TLS leg sends in small records after idling.
+ *
+ * Every command gets exactly one reply line, either "ok ..." or
+ * "err REASON".  "add" only queues the pair with the connect scheduler and
+ * replies at once; a pair whose connect fails later drops out of "list".
+ * Clients may pipeline any number of commands in one write; the whole
+ * batch is executed in one loop iteration and the replies go back in a
+ * single write.  Clients that do not read their replies are dropped
+ * rather than allowed to stall the relay.
+ */
+#define CTL_CLIENTS 16
+#define CTL_LINE    4096
+#define CTL_REPLY   65536
+
+static int ctl_listen = -1;
+static struct ctl_client
+{
+    int fd;
+    size_t len;
+    char in[CTL_LINE];
+} ctl_clients[CTL_CLIENTS];
+
+static int ctl_open(const char *path)
+{
+    struct sockaddr_un sa;
+
+    bzero(&sa, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+        log_msg("control socket path too long");
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if ((ctl_listen = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        log_errno("socket");
+        return -1;
+    }
+    if (bind(ctl_listen, (struct sockaddr *) &sa, sizeof(sa)) || listen(ctl_listen, 16))
+    {
+        log_errno("control socket");
+        close(ctl_listen);
+        ctl_listen = -1;
+        return -1;
+    }
+    fcntl(ctl_listen, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static void ctl_accept(void)
+{
+    int fd, i;
+
+    if ((fd = accept(ctl_listen, NULL, NULL)) < 0)
+        return;
+    for (i = 0; i < CTL_CLIENTS && ctl_clients[i].fd >= 0; ++i)
+        ;
+    if (i == CTL_CLIENTS || fd >= FD_SETSIZE)
+    {
+        log_msg("too many control clients");
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    ctl_clients[i].fd = fd;
+    ctl_clients[i].len = 0;
+}
+
+/* parse a pair id argument, returns NULL if it does not name a live pair */
+static struct pair *ctl_pair(const char *arg)
+{
+    char *end;
+    long id;
+
+    if (!arg)
+        return NULL;
+    id = strtol(arg, &end, 10);
+    if (*end || end == arg || id < 0 || id >= MAX_PAIRS || !pairs[id].used)
+        return NULL;
+    return &pairs[id];
+}
+
+/* execute one command line, appending its reply to out */
+static int ctl_exec(char *line, char *out, size_t size)
+{
+    char *argv[7], *save = NULL;
+    struct pair *p;
+    unsigned int pace;
+    int argc = 0, id, n, i;
+
+    for (argv[0] = strtok_r(line, " \t\r", &save); argv[argc] && argc < 6; )
+        argv[++argc] = strtok_r(NULL, " \t\r", &save);
+    if (!argc)
+        return 0;
+    if (argv[argc])
+        return snprintf(out, size, "err bad command\n");
+
+    if (!strcmp(argv[0], "add") && (argc == 5 || argc == 6))
+    {
+        char *host[2] = { argv[1], argv[3] }, *port[2] = { argv[2], argv[4] };
+
+        if ((id = pair_open(host, port, argc == 6 ? argv[5] : NULL)) < 0)
+            return snprintf(out, size, "err add failed\n");
+        return snprintf(out, size, "ok %d\n", id);
+    }
+    if (!strcmp(argv[0], "list") && argc == 1)
+    {
+        n = snprintf(out, size, "ok");
+        for (id = 0; id < MAX_PAIRS && n < (int) size; ++id)
+            if (pairs[id].used)
+                n += snprintf(out + n, size - n, " %d", id);
+        if (n < (int) size)
+            n += snprintf(out + n, size - n, "\n");
+        return n;
+    }
+    if (!strcmp(argv[0], "rate") && argc == 4)
+    {
+        if (!(p = ctl_pair(argv[1])))
+            return snprintf(out, size, "err no such pair\n");
+        if (strcmp(argv[2], "1") && strcmp(argv[2], "2"))
+            return snprintf(out, size, "err bad leg\n");
+        i = argv[2][0] - '1';
+        pace = p->pace[i];
+        p->pace[i] = (unsigned int) strtoul(argv[3], NULL, 10);
+        if (leg_pace(p, i))
+        {
+            p->pace[i] = pace;          /* the old cap is still the one in effect */
+            return snprintf(out, size, "err pacing not available\n");
+        }
+        return snprintf(out, size, "ok\n");
+    }
+    if (!strcmp(argv[0], "record") && argc == 4)
+    {
+        if (!(p = ctl_pair(argv[1])))
+            return snprintf(out, size, "err no such pair\n");
+        if (strcmp(argv[2], "1") && strcmp(argv[2], "2"))
+            return snprintf(out, size, "err bad leg\n");
+        i = argv[2][0] - '1';
+        p->tls_ramp[i] = strtoull(argv[3], NULL, 10);
+        return snprintf(out, size, "ok\n");
+    }
+    if (argc != 2)
+        return snprintf(out, size, "err bad command\n");
+    if (!(p = ctl_pair(argv[1])))
+        return snprintf(out, size, "err no such pair\n");
+    if (!strcmp(argv[0], "del"))
+        pair_close(p);
+    else if (!strcmp(argv[0], "pause"))
+        p->paused = 1;
+    else if (!strcmp(argv[0], "resume"))
+        p->paused = 0;
+    else if (!strcmp(argv[0], "stats"))
+    {
+        if (clock_now_ms() - p->win_start >= RATE_WINDOW_MS)
+            rate_roll(p);
+        return snprintf(out, size, "ok %d %llu %llu %d %llu %llu %u %u %llu\n", (int) (p - pairs),
+                        p->bytes[0], p->bytes[1], p->paused, p->rate[0], p->rate[1],
+                        p->pace[0], p->pace[1], p->spool.bytes);
+    }
+    else
+        return snprintf(out, size, "err bad command\n");
+    return snprintf(out, size, "ok\n");
+}
+
+static void ctl_drop(struct ctl_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* read a batch of commands from a client and answer all of them */
+static void ctl_serve(struct ctl_client *c)
+{
+    static char reply[CTL_REPLY];
+    size_t rlen = 0, start, i;
+    ssize_t n;
+
+    if ((n = read(c->fd, c->in + c->len, sizeof(c->in) - c->len)) <= 0)
+    {
+        if (n == 0 || errno != EAGAIN)
+            ctl_drop(c);
+        return;
+    }
+    c->len += n;
+    for (start = i = 0; i < c->len; ++i)
+    {
+        if (c->in[i] != '\n')
+            continue;
+        c->in[i] = '\0';
+        if (rlen + CTL_LINE > sizeof(reply))
+        {
+            if (write(c->fd, reply, rlen) != (ssize_t) rlen)
+            {
+                ctl_drop(c);
+                return;
+            }
+            rlen = 0;
+        }
+        rlen += ctl_exec(c->in + start, reply + rlen, CTL_LINE);
+        start = i + 1;
+    }
+    if (start == 0 && c->len == sizeof(c->in))
+    {
+        log_msg("control command too long");
+        ctl_drop(c);
+        return;
+    }
+    memmove(c->in, c->in + start, c->len - start);
+    c->len -= start;
+    if (rlen && write(c->fd, reply, rlen) != (ssize_t) rlen)
+    {
+        log_msg("control client not reading replies, dropped");
+        ctl_drop(c);
+    }
+}
+#endif
+
+int main(int argc, char *argv[])
+{ 
+    SOCKET maxsock;
+    fd_set fdsr, fdsw;
+    struct timeval tv;
+    long wait, faults = 0;
+    int argi, id, i;
+    const char *ctlpath = NULL, *zdictpath = NULL, *pskpath = NULL, *cafile = NULL, *routepath = NULL;
+    int tls = 0;
+
+#if defined(__WIN32__) || defined(WIN32) || defined(_WIN32)
+    /* Winsock needs additional startup activities */
+    WSADATA wsadata;
+    WSAStartup(MAKEWORD(1,1), &wsadata);
+#endif
+
+    /* options */
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi)
+    {
+        if (!strcmp(argv[argi], "-m") && argi + 1 < argc)
+            connect_max = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-d") && argi + 1 < argc)
+            connect_per_dest = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-j") && argi + 1 < argc)
+            connect_jitter = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-b") && argi + 1 < argc)
+            load_factor = atof(argv[++argi]);
+        else if (!strcmp(argv[argi], "-H") && argi + 1 < argc)
+            health_interval = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-r") && argi + 1 < argc)
+            pace_default = (unsigned int) strtoul(argv[++argi], NULL, 10);
+        else if (!strcmp(argv[argi], "-t"))
+            autotune = 0;
+        else if (!strcmp(argv[argi], "-s"))
+            session_mode = 1;
+        else if (!strcmp(argv[argi], "-u") && argi + 1 < argc)
+        {
+            udp_mode = 1;
+            udp_port = (unsigned short) atoi(argv[++argi]);
+        }
+        else if (!strcmp(argv[argi], "-p") && argi + 1 < argc)
+            session_paths = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-D") && argi + 1 < argc)
+            dedup_mb = (unsigned int) strtoul(argv[++argi], NULL, 10);
+        else if (!strcmp(argv[argi], "-C") && argi + 1 < argc)
+            compress_level = atoi(argv[++argi]);
+        else if (!strcmp(argv[argi], "-Z") && argi + 1 < argc)
+            zdictpath = argv[++argi];
+        else if (!strcmp(argv[argi], "-K") && argi + 1 < argc)
+            pskpath = argv[++argi];
+        else if (!strcmp(argv[argi], "-T"))
+            tls = 1;
+        else if (!strcmp(argv[argi], "-A") && argi + 1 < argc)
+            cafile = argv[++argi];
+        else if (!strcmp(argv[argi], "-N") && argi + 1 < argc)
+            tls_name = argv[++argi];
+        else if (!strcmp(argv[argi], "-W") && argi + 1 < argc)
+            tls_ramp = strtoull(argv[++argi], NULL, 10);
+        else if (!strcmp(argv[argi], "-L") && argi + 1 < argc)
+            trim_ms = strtoull(argv[++argi], NULL, 10);
+        else if (!strcmp(argv[argi], "-E") && argi + 1 < argc)
+            routepath = argv[++argi];
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        else if (!strcmp(argv[argi], "-c") && argi + 1 < argc)
+            ctlpath = argv[++argi];
+        else if (!strcmp(argv[argi], "-R"))
+            realtime = 1;
+        else if (!strcmp(argv[argi], "-S") && argi + 1 < argc)
+            spool_dir = argv[++argi];
+        else if (!strcmp(argv[argi], "-F") && argi + 1 < argc)
+            spool_sync_ms = atoi(argv[++argi]);
+#endif
+        else
+            break;
+    }
+
+    /* check number of command line arguments */
+    if ((argc - argi != 4 && !(ctlpath && argc == argi)) || connect_max < 1 || connect_per_dest < 1
+        || load_factor < 1.0 || health_interval < 0 || spool_sync_ms < 0
+        || session_paths < 1 || session_paths > SESSION_PATHS_MAX
+        || compress_level < 0 || compress_level > 9 || (udp_mode && session_mode)
+        || (pskpath && !session_mode) || (tls && session_mode)
+        || (routepath && (session_mode || udp_mode)) || (realtime && trim_ms && (tls || routepath)))
+    {
+        fprintf(stderr, "Usage: %s [-c controlsocket] [-m maxconnects] [-d maxconnectsperdest] [-j jitterms]\n"
+                        "       [-b loadfactor] [-H healthcheckms] [-r pacingbytespersec] [-t] [-R]\n"
+                        "       [-S spooldir] [-F spoolsyncms] [-s] [-p paths] [-D dedupcachemb]\n"
+                        "       [-C compresslevel] [-Z dictfile] [-u udplocalport] [-K keyfile]\n"
+                        "       [-T] [-A cafile] [-N servername] [-W tlsrampbytes] [-L idlems]\n"
+                        "       [-E routefile]\n"
+                        "       remotehost1 remoteport1 remotehost2[,host[:port]...] remoteport2\n"
+                        "A host of - (with any port) means stdin/stdout.\n", argv[0]);
+        return -1;
+    }
+
+    log_init();
+    srand((unsigned int) time(NULL));
+
+    /* a dictionary means compressing with it */
+    if (zdictpath)
+    {
+        if (zdict_load(zdictpath))
+            return -1;
+        if (!compress_level)
+            compress_level = 6;
+    }
+    if (pskpath && psk_load(pskpath))
+        return -1;
+    if (tls && tls_init(cafile))
+        return -1;
+    if (routepath && route_load(routepath))
+        return -1;
+    if (compress_level)
+        zdict_sum = adler32(adler32(0L, Z_NULL, 0), zdict, (uInt) zdict_len);
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+    /* a peer going away must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* control commands reach the loop through the command queue */
+    if (cmdq_init())
+    {
+        log_errno("cmdq_init");
+        return -1;
+    }
+    signal(SIGUSR1, on_sigusr1);
+
+    for (i = 0; i < CTL_CLIENTS; ++i)
+        ctl_clients[i].fd = -1;
+    if (ctlpath && ctl_open(ctlpath))
+        return -1;
+
+    if (realtime && rt_init())
+        return -1;
+#endif
+
+    /* connect to servers */
+    if (argc - argi == 4)
+    {
+        char *host[2] = { argv[argi], argv[argi + 2] }, *port[2] = { argv[argi + 1], argv[argi + 3] };
+
+        if (pair_open(host, port, NULL) < 0)
+            return -1;
+    }
+
+    /* main polling loop. */
+    while (npairs || ctlpath)
+    {
+        connect_schedule();
+        health_run();
+        tune_run();
+        relay_trim();
+        spool_run();
+        log_run();
+
+        FD_ZERO(&fdsr);
+        FD_ZERO(&fdsw);
+        maxsock = 0;
+        tls_ready = 0;
+        for (id = 0; id < MAX_PAIRS; ++id)
+            if (pairs[id].used)
+                pair_fdset(&pairs[id], &fdsr, &fdsw, &maxsock);
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        FD_SET(cmdq_fd[0], &fdsr);
+        if (cmdq_fd[0] > maxsock)
+            maxsock = cmdq_fd[0];
+        if (ctl_listen >= 0)
+        {
+            FD_SET(ctl_listen, &fdsr);
+            if (ctl_listen > maxsock)
+                maxsock = ctl_listen;
+        }
+        for (i = 0; i < CTL_CLIENTS; ++i)
+        {
+            if (ctl_clients[i].fd < 0)
+                continue;
+            FD_SET(ctl_clients[i].fd, &fdsr);
+            if (ctl_clients[i].fd > maxsock)
+                maxsock = ctl_clients[i].fd;
+        }
+#endif
+        health_fdset(&fdsw, &maxsock);
+        wait = wakeup_min(connect_next_wakeup(), health_next_wakeup());
+        wait = wakeup_min(wait, tune_next_wakeup());
+        wait = wakeup_min(wait, trim_next_wakeup());
+        wait = wakeup_min(wait, log_next_wakeup());
+        wait = wakeup_min(wait, tls_next_wakeup());
+        wait = wakeup_min(wait, spool_next_wakeup());
+        wait = wakeup_min(wait, sess_next_wakeup());
+        if (wait >= 0)
+        {
+            tv.tv_sec = wait / 1000;
+            tv.tv_usec = (wait % 1000) * 1000;
+        }
+        if (select(maxsock + 1, &fdsr, &fdsw, NULL, wait >= 0 ? &tv : NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        clock_refresh();
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        if (FD_ISSET(cmdq_fd[0], &fdsr))
+            cmdq_drain();
+#endif
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        if (realtime)
+            faults = rt_fault_count();
+#endif
+        for (id = 0; id < MAX_PAIRS; ++id)
+            if (pairs[id].used)
+                pair_service(&pairs[id], &fdsr, &fdsw);
+        sess_run();                     /* session timers send and code data too */
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        if (realtime && (faults = rt_fault_count() - faults) > 0)
+        {
+            rt_faults += faults;
+            log_msg("realtime: %ld page faults on the relay path", faults);
+        }
+#endif
+        health_check(&fdsw);
+
+#if !defined(__WIN32__) && !defined(WIN32) && !defined(_WIN32)
+        /* control clients last, so new pairs are not looked up in fdsr */
+        for (i = 0; i < CTL_CLIENTS; ++i)
+            if (ctl_clients[i].fd >= 0 && FD_ISSET(ctl_clients[i].fd, &fdsr))
+                ctl_serve(&ctl_clients[i]);
+        if (ctl_listen >= 0 && FD_ISSET(ctl_listen, &fdsr))
+            ctl_accept();
+#endif
     }
     
-  return 0;
+  return connect_failures ? -1 : 0;
 }